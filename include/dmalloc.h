@@ -2,33 +2,71 @@
 #define DMALLOC_H
 #include <stddef.h>
 #include <stdint.h>
+#include <stdatomic.h>
+#include "size_classes.h"
+#include "page_heap.h"
+#include "percpu.h"
 #define D_ALIGN     16
-#define MAX_SMALL   1024
+#define MAX_SMALL   SIZE_CLASS_MAX
+
+/* requests above this many bytes bypass the page heap and get their own mmap */
+#ifndef DMALLOC_DIRECT_THRESHOLD
+#define DMALLOC_DIRECT_THRESHOLD (1024 * 1024)
+#endif
+
+/* bytes all thread caches together may hold; busy threads take capacity
+ * from idle ones once it is spent */
+#ifndef DMALLOC_TCACHE_BUDGET
+#define DMALLOC_TCACHE_BUDGET (32 * 1024 * 1024)
+#endif
+
+/* initial-exec TLS: thread state is reached without __tls_get_addr, which can
+ * allocate, so the allocator also works as an LD_PRELOAD malloc */
+#define DMALLOC_TLS __thread __attribute__((tls_model("initial-exec")))
 
 /* ObjHdr flags */
 #define OBJ_FLAG_LARGE   0x1  /* object spans pages (large path) */
 #define OBJ_FLAG_DIRECT  0x2  /* directly mmapped (not via Span metadata) */
 
+/* ObjHdr only prefixes large/direct objects; small slots are headerless and
+ * resolved through the page heap pagemap, and so are aligned large spans */
 typedef struct _ObjHdr {
-    void* owner;          /* SmallSpan* for small; Span* for large; NULL for direct */
-    size_t size_class;    /* small: class index; direct: npages; large: sentinel */
+    void* owner;          /* Span* for large; mapping base for direct */
+    size_t size_class;    /* npages of the block */
     uint16_t flags;       /* bit0: large; bit1: direct */
 } ObjHdr;
 
-typedef struct _CentralFreeList {
-    void*   head;         /* singly list of ObjHdr* (stored in payload) */
-    size_t  obj_size;     /* payload size for this class */
-} CentralFreeList;
-
 typedef struct _SmallSpan {
     size_t  size_class;   /* owning size class */
     size_t  total_objs;   /* number of objects in this span */
     size_t  free_objs;    /* number of free objects currently */
+    int     shard;        /* central shard that carved this span */
+    int     bin;          /* occupancy bin in the central list; -1 when full */
+    void*   freelist;     /* freed slots of this span (link stored in payload) */
+    uint8_t* bump;        /* next never-used slot; slots are carved lazily */
+    uint8_t* bump_end;    /* end of the last whole slot */
+    struct _SmallSpan* next; /* central bin links */
+    struct _SmallSpan* prev;
+    struct _Span* span;   /* backing page heap span (Span.owner points back) */
+    struct _SmallSpan* next_meta; /* metadata pool link while unused */
 } SmallSpan;
 
+/* spans with free slots, bucketed by how many of their slots are in use */
+#define CENTRAL_OCC_BINS 8
+
+typedef struct _CentralFreeList {
+    SmallSpan* bins[CENTRAL_OCC_BINS]; /* bins[i]: spans with i/8..(i+1)/8 slots in use */
+    unsigned nonempty;    /* bit i set while bins[i] is non-empty */
+    size_t  obj_size;     /* payload size for this class */
+    size_t  count;        /* free slots across all binned spans */
+} CentralFreeList;
+
 typedef struct {
     void* head;
     size_t count;
+    size_t max;           /* objects kept before a batch goes back to central; adaptive */
+    uint32_t overflows;   /* flushes since max last changed */
+    uint32_t mixed;       /* took sized frees, which skip the shard check */
 } TCacheList;
 
 typedef struct {
@@ -41,14 +79,161 @@ typedef struct {
 #define LARGE_BUCKET_COUNT 16
 
 typedef struct {
-    TCacheList  lists[ (MAX_SMALL / D_ALIGN) ];
+    TCacheList  lists[ SIZE_CLASS_COUNT ];
     LargeBucket lbuckets[LARGE_BUCKET_COUNT];
     int shard_id; /* computed shard index for central freelists */
+    void* next_free; /* recycle pool link once the owning thread exited */
+    /* capacity accounting against DMALLOC_TCACHE_BUDGET */
+    atomic_size_t capacity; /* sum of max * slot size over the lists */
+    atomic_size_t owed;     /* bytes other threads took over; paid on the next slow path */
+    atomic_size_t misses;   /* refills so far; unchanged between steal rounds means idle */
+    size_t misses_seen;     /* misses at the last steal round; under the pool lock */
+    int next_shrink;        /* class the next payment starts shrinking at */
+    void* next_live;        /* live thread caches, for stealing; under the pool lock */
 } ThreadCache;
 
 void* dmalloc(size_t size);
 void  dfree(void* ptr);
+/* free with the size ptr was allocated with (dmalloc, dcalloc or drealloc;
+ * aligned objects need dfree). The class comes from the size, so a small
+ * object is cached without a pagemap lookup; DMALLOC_DEBUG builds check the
+ * size against the span metadata and abort on a mismatch */
+void  dfree_sized(void* ptr, size_t size);
+/* n objects of one size into out; returns how many were allocated, which is
+ * n unless memory ran out. dfree_batch frees any mix of objects */
+size_t dmalloc_batch(size_t size, void** out, size_t n);
+void   dfree_batch(void** ptrs, size_t n);
+/* n * size zeroed bytes; NULL on overflow */
+void* dcalloc(size_t n, size_t size);
 void* drealloc(void* ptr, size_t size);
 void  dmalloc_init(void);
+/* align must be a power of two; NULL if it is not or memory is exhausted.
+ * dmemalign is the same with memalign's argument order */
+void* dmalloc_aligned(size_t size, size_t align);
+void* dmemalign(size_t align, size_t size);
+/* bytes usable from ptr, which must be live and returned by the allocator */
+size_t dmalloc_usable_size(void* ptr);
+
+/* thread cache capacity in bytes: the calling thread's, and claimed from the
+ * budget by all threads (either pointer may be NULL) */
+void  dmalloc_tcache_stats(size_t* thread_bytes, size_t* total_bytes);
+
+/* opt-in background scavenger: a thread hands free spans that stayed idle
+ * for a full interval back to the OS at about bytes_per_sec. While it runs
+ * frees never madvise inline. start returns 0 on success (or if running) */
+int   dmalloc_scavenger_start(size_t bytes_per_sec);
+void  dmalloc_scavenger_stop(void);
+/* bytes of whole batches parked in the transfer caches */
+size_t dmalloc_transfer_bytes(void);
+/* hand batches parked between thread caches and central back, then return
+ * every free span to the OS; returns the pages released */
+size_t dmalloc_trim(void);
+
+/* region arena: alloc bump-allocates D_ALIGN aligned memory from page heap
+ * spans, objects are never freed on their own and destroy releases all of
+ * it. An arena is not thread safe; NULL when memory is exhausted */
+typedef struct _DmallocArena DmallocArena;
+DmallocArena* dmalloc_arena_create(void);
+void* dmalloc_arena_alloc(DmallocArena* a, size_t size);
+void  dmalloc_arena_destroy(DmallocArena* a);
+
+/* fast path: a thread cache hit is a table load plus a list pop/push, with no
+ * atomics and no init checks. Everything else (first touch, refills,
+ * overflow, large and foreign objects) goes through the out-of-line slow
+ * paths, which are also what dmalloc()/dfree() fall back to. */
+extern DMALLOC_TLS ThreadCache* dmalloc_tls_tc;
+void* dmalloc_slow(size_t size);
+void  dfree_slow(void* ptr);
+#ifdef DMALLOC_DEBUG
+void  dmalloc_check_size(void* ptr, size_t size);
+#endif
+
+#ifdef PERCPU_SUPPORTED
+/* rseq area of this thread once per-CPU caches are usable; NULL before the
+ * first slow-path call or when registration failed */
+extern DMALLOC_TLS void* dmalloc_tls_rseq;
+#endif
+
+static inline void* dmalloc_inline(size_t size)
+{
+#ifdef PERCPU_SUPPORTED
+    void* rs = dmalloc_tls_rseq;
+    if (__builtin_expect(rs != NULL && size <= MAX_SMALL, 1)){
+        void* p = percpu_pop(rs, size_class_lookup[size_class_lookup_index(size)]);
+        if (__builtin_expect(p != NULL, 1)) return p;
+        return dmalloc_slow(size);
+    }
+#endif
+    ThreadCache* tc = dmalloc_tls_tc;
+    if (__builtin_expect(tc != NULL && size <= MAX_SMALL, 1)){
+        TCacheList* list = &tc->lists[ size_class_lookup[size_class_lookup_index(size)] ];
+        void* p = list->head;
+        if (__builtin_expect(p != NULL, 1)){
+            list->head = *(void**)p;
+            list->count--;
+            return p;
+        }
+    }
+    return dmalloc_slow(size);
+}
+
+static inline void dfree_inline(void* ptr)
+{
+    ThreadCache* tc = dmalloc_tls_tc;
+    Span* sp = pageheap_span_of(ptr);
+    SmallSpan* ss = sp ? (SmallSpan*)sp->owner : NULL;
+#ifdef PERCPU_SUPPORTED
+    /* per-CPU slabs are not tied to a shard, so any small object fits */
+    void* rs = dmalloc_tls_rseq;
+    if (__builtin_expect(rs != NULL && ss != NULL, 1)){
+        if (__builtin_expect(percpu_push(rs, (int)ss->size_class, ptr), 1)) return;
+        dfree_slow(ptr);
+        return;
+    }
+#endif
+    if (__builtin_expect(tc != NULL && ss != NULL && ss->shard == tc->shard_id, 1)){
+        TCacheList* list = &tc->lists[ss->size_class];
+        if (__builtin_expect(list->count < list->max, 1)){
+            *(void**)ptr = list->head;
+            list->head = ptr;
+            list->count++;
+            return;
+        }
+    }
+    dfree_slow(ptr);
+}
+
+/* no span lookup means no shard check: an object another shard carved can sit
+ * in this list until it overflows. The list is marked so its flushes look
+ * the shards up and send such objects back to their owner */
+static inline void dfree_sized_inline(void* ptr, size_t size)
+{
+#ifdef DMALLOC_DEBUG
+    dmalloc_check_size(ptr, size);
+#endif
+    if (__builtin_expect(ptr != NULL && size <= MAX_SMALL, 1)){
+        int sc = size_class_lookup[size_class_lookup_index(size)];
+#ifdef PERCPU_SUPPORTED
+        void* rs = dmalloc_tls_rseq;
+        if (__builtin_expect(rs != NULL, 1)){
+            if (__builtin_expect(percpu_push(rs, sc, ptr), 1)) return;
+            dfree_slow(ptr);
+            return;
+        }
+#endif
+        ThreadCache* tc = dmalloc_tls_tc;
+        if (__builtin_expect(tc != NULL, 1)){
+            TCacheList* list = &tc->lists[sc];
+            if (__builtin_expect(list->count < list->max, 1)){
+                *(void**)ptr = list->head;
+                list->head = ptr;
+                list->count++;
+                list->mixed = 1;
+                return;
+            }
+        }
+    }
+    dfree_slow(ptr);
+}
 
 #endif /* DMALLOC_H */
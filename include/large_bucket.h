@@ -3,15 +3,19 @@
 
 #include "page_heap.h"
 
-/* initialize skiplist for large bucket */
+/* reset the segregated lists and their bitmaps */
 void large_bucket_init(PageHeap* heap);
 
-/* insert/remove span into/from large bucket skiplist */
+/* insert/remove span into/from its size class list */
 void large_bucket_insert(PageHeap* heap, Span* s);
 void large_bucket_remove(PageHeap* heap, Span* s);
 
-/* find the first span with page_count >= need (best-fit by size) */
+/* find a span with page_count >= need (good fit, O(1) via bitmaps) */
 Span* large_bucket_lower_bound(PageHeap* heap, size_t need);
 
-#endif /* LARGE_BUCKET_H */
+/* iteration in class order: first span of the class holding min_pages or
+ * any later class (smaller spans may share that class), then the next one */
+Span* large_bucket_first(PageHeap* heap, size_t min_pages);
+Span* large_bucket_next(PageHeap* heap, Span* s);
 
+#endif /* LARGE_BUCKET_H */
@@ -5,28 +5,77 @@
 
 #define MAX_BUCKETS (64)
 #define DEFAULT_GROW_PAGES (64)
-#define MAX_SKIP_LEVELS (16)
 #define META_CHUNK_NEW_SIZE (1024)
 
-typedef struct _Span{
+/* the heap grows inside one PROT_NONE reservation, committed on demand;
+ * plain mmap is only the fallback once it is exhausted */
+#ifndef PAGEHEAP_ARENA_BYTES
+#define PAGEHEAP_ARENA_BYTES ((size_t)64 << 30)
+#endif
+/* optional hugepage-aware placement (-DDMALLOC_HUGEPAGE): the arena is
+ * hugepage aligned and MADV_HUGEPAGE, growth commits whole hugepages, free
+ * spans in partly used hugepages are handed out first, and release/madvise
+ * only touch hugepages with no page in use */
+#define HUGEPAGE_SIZE ((size_t)2 << 20)
+
+/* in_use value of a decommitted arena range waiting to be reused */
+#define SPAN_RETURNED (2)
+
+/* large bucket: TLSF-style two-level segregated lists for spans of
+ * MAX_BUCKETS pages or more. The first level is log2(page_count), the
+ * second splits each power of two into LARGE_SL_COUNT equal ranges */
+#define LARGE_FL_SHIFT (6)   /* log2(MAX_BUCKETS) */
+#define LARGE_FL_COUNT (64 - LARGE_FL_SHIFT)
+#define LARGE_SL_BITS  (3)
+#define LARGE_SL_COUNT (1 << LARGE_SL_BITS)
+
+/* pagemap: two-level radix tree from page number to owning Span */
+#define PAGEMAP_ADDR_BITS (48)
+#define PAGEMAP_LEAF_BITS (18)
+
+/* one cache line per span record */
+typedef struct __attribute__((aligned(64))) _Span{
+    void *start;
+    size_t page_count;
+    size_t in_use;
+    struct _Span* next_free_addr; /* size bucket links while free; pool link while unused */
+    struct _Span* prev_free_addr;
+    void* owner;          /* client metadata of an in-use span (e.g. SmallSpan*) */
+    uint32_t released;    /* free and already madvised; cleared when reused */
+    uint32_t free_epoch;  /* scavenge epoch in which it last became free */
+    uint32_t zeroed;      /* every page reads as zero: fresh or madvised, never freed dirty */
+} Span;
+
+_Static_assert(sizeof(Span) <= 64, "Span must fit in one cache line");
+
+/* the earlier span record, with address list links and a 16-level skiplist
+ * tower inline; only its size is used, to report the metadata saved */
+typedef struct _SkiplistSpan{
     void *start;
     size_t page_count;
     size_t in_use;
     struct _Span* next_addr;
     struct _Span* prev_addr;
     struct _Span* next_free_addr;
-
-    /* skiplist fields for large bucket */
-    struct _Span* skip_next[MAX_SKIP_LEVELS];
+    struct _Span* skip_next[16];
     unsigned char skip_level;
-} Span;
+} SkiplistSpan;
 
 typedef struct _PageHeap{
     size_t page_size;
     Span* free_buckets[MAX_BUCKETS];
-    Span* addr_head;
-    /* skiplist head for large bucket */
-    Span* large_skip_head;
+    uint64_t free_mask;   /* bit i set while free_buckets[i] is non-empty */
+#ifdef DMALLOC_HUGEPAGE
+    Span* free_tails[MAX_BUCKETS]; /* spans in idle hugepages queue up here */
+#endif
+    Span* returned;       /* decommitted arena ranges, reused before the frontier */
+    /* large bucket lists and their occupancy bitmaps */
+    Span* large_lists[LARGE_FL_COUNT][LARGE_SL_COUNT];
+    uint64_t large_fl_mask;
+    uint32_t large_sl_mask[LARGE_FL_COUNT];
+    size_t span_records;  /* Span records carved from metadata chunks */
+    size_t released_pages;
+    uint32_t epoch;       /* bumped by each pageheap_scavenge() call */
     size_t mapped_pages;
     size_t free_pages;
     size_t spans_in_use;
@@ -39,6 +88,9 @@ typedef struct _PageHeapStats {
     size_t free_pages;
     size_t spans_in_use;
     size_t spans_free;
+    size_t released_pages;   /* free pages already returned with madvise */
+    size_t meta_bytes;       /* span metadata mapped */
+    size_t meta_bytes_saved; /* what the same records took in the SkiplistSpan layout, less meta_bytes */
 } PageHeapStats;
 
 void pageheap_init(void);
@@ -46,11 +98,40 @@ size_t pageheap_page_size(void);
 
 /*alloc at least page_count pages*/
 Span* span_alloc(size_t page_count);
+/*alloc page_count pages starting at a multiple of align_pages pages
+ *(a power of two)*/
+Span* span_alloc_aligned(size_t page_count, size_t align_pages);
 void span_free(Span* span);
 
+/*resize an in-use span in place: extend absorbs the free span right after it,
+ *shrink frees the tail. 0 on success, -1 if it has to move*/
+int span_extend(Span* span, size_t page_count);
+int span_shrink(Span* span, size_t page_count);
+
 /*increase page heap capacity from OS*/
 int pageheap_grow(size_t page_count);
 
+/*pagemap internals; exposed only so pageheap_span_of can be inlined*/
+extern Span*** pageheap_pagemap_root;
+extern size_t pageheap_pagemap_len;
+extern size_t pageheap_pagemap_shift;
+
+/*map an address inside an in-use span back to its Span; NULL if not heap memory.
+ *free spans are only recorded at their first and last page (boundary tags)*/
+static inline Span* pageheap_span_of(const void* p)
+{
+    uintptr_t page = (uintptr_t)p >> pageheap_pagemap_shift;
+    uintptr_t i = page >> PAGEMAP_LEAF_BITS;
+    if (i >= pageheap_pagemap_len) return NULL;
+    Span** leaf = pageheap_pagemap_root[i];
+    if (!leaf) return NULL;
+    return leaf[page & (((uintptr_t)1 << PAGEMAP_LEAF_BITS) - 1)];
+}
+
+/*fork handlers: the forking thread holds the heap lock across fork(), so the
+ *child never inherits it mid-update; release runs in parent and child*/
+void pageheap_fork_prepare(void);
+void pageheap_fork_release(void);
 /*read Span metadata*/
 void* span_ptr(Span* span);
 size_t span_page_count(Span* span);
@@ -60,8 +141,13 @@ PageHeapStats pageheap_stats(void);
 /*release fully free spans back to OS via munmap; returns released pages*/
 size_t pageheap_release_empty_spans(size_t min_pages);
 
-/*soft reclaim: advise OS that pages are not needed; returns advised pages*/
+/*soft reclaim: advise OS that pages are not needed; spans advised before and
+ *not reused since are skipped. returns advised pages*/
 size_t pageheap_madvise_idle_spans(size_t min_pages);
 
+/*background reclaim step: advise up to about max_pages of free spans that
+ *stayed free since the previous call; returns advised pages*/
+size_t pageheap_scavenge(size_t max_pages);
+
 
 #endif
@@ -0,0 +1,143 @@
+#ifndef PERCPU_H
+#define PERCPU_H
+#include <stddef.h>
+#include <stdint.h>
+#include "size_classes.h"
+
+/* Optional per-CPU object caches built on Linux restartable sequences.
+ * Build with -DDMALLOC_PERCPU to enable; only x86-64 Linux is supported and
+ * threads whose rseq registration fails keep using their ThreadCache.
+ *
+ * Every CPU owns a slab: a header holding one uint32 "current" index per
+ * size class, followed by an array of object pointers. Class sc owns slots
+ * [percpu_begin[sc], percpu_end[sc]) and the slab is empty/full for that
+ * class when current reaches begin/end. A pop or push is one rseq critical
+ * section whose only side effect is the final store to the header, so a
+ * preemption, migration or signal simply restarts it. */
+
+#if defined(DMALLOC_PERCPU) && defined(__linux__) && defined(__x86_64__)
+#define PERCPU_SUPPORTED 1
+#endif
+
+#define PERCPU_HDR_BYTES 512
+#define PERCPU_STR_(x) #x
+#define PERCPU_STR(x) PERCPU_STR_(x)
+
+/* signature glibc and we register with; must precede every abort handler */
+#define PERCPU_RSEQ_SIG 0x53053053
+/* field offsets inside the kernel's struct rseq */
+#define RSEQ_OFF_CPU_ID 4
+#define RSEQ_OFF_CS     8
+
+/* map the per-CPU slabs; 0 on success, -1 when per-CPU mode is unavailable */
+int   percpu_init(void);
+/* rseq area of the calling thread, registering it if libc did not; NULL on failure */
+void* percpu_register(void);
+
+#ifdef PERCPU_SUPPORTED
+extern uint8_t* percpu_base;
+extern uint8_t  percpu_shift;   /* log2 of the per-CPU slab stride */
+extern uint32_t percpu_begin[SIZE_CLASS_COUNT];
+extern uint32_t percpu_end[SIZE_CLASS_COUNT];
+
+/* CPU the thread last ran on; only a hint outside a critical section */
+static inline int percpu_cpu(void* rs)
+{
+    return *(volatile int32_t*)((char*)rs + RSEQ_OFF_CPU_ID);
+}
+
+/* pop an object of class sc from the current CPU's slab; NULL when empty */
+static inline void* percpu_pop(void* rs, int sc)
+{
+    for (;;){
+        void* p;
+        long status;
+        __asm__ __volatile__(
+            ".pushsection __rseq_cs, \"aw\"\n\t"
+            ".balign 32\n\t"
+            "3:\n\t"
+            ".long 0x0, 0x0\n\t"
+            ".quad 1f, (2f - 1f), 4f\n\t"
+            ".popsection\n\t"
+            "movq $1, %[status]\n\t"
+            "xorl %k[res], %k[res]\n\t"
+            "leaq 3b(%%rip), %%rax\n\t"
+            "movq %%rax, %[rseq_cs]\n\t"
+            "1:\n\t"
+            "movl %[cpu_id], %%eax\n\t"
+            "shlq %%cl, %%rax\n\t"
+            "addq %[base], %%rax\n\t"
+            "movl (%%rax,%[sc],4), %%edx\n\t"
+            "cmpl %k[begin], %%edx\n\t"
+            "je 2f\n\t"
+            "subl $1, %%edx\n\t"
+            "movq " PERCPU_STR(PERCPU_HDR_BYTES) "(%%rax,%%rdx,8), %[res]\n\t"
+            "movq $0, %[status]\n\t"
+            "movl %%edx, (%%rax,%[sc],4)\n\t"
+            "2:\n\t"
+            ".pushsection __rseq_failure, \"ax\"\n\t"
+            ".byte 0x0f, 0xb9, 0x3d\n\t"
+            ".long " PERCPU_STR(PERCPU_RSEQ_SIG) "\n\t"
+            "4:\n\t"
+            "movq $2, %[status]\n\t"
+            "jmp 2b\n\t"
+            ".popsection\n\t"
+            : [status] "=&r" (status), [res] "=&r" (p),
+              [rseq_cs] "=m" (*(uint64_t*)((char*)rs + RSEQ_OFF_CS))
+            : [cpu_id] "m" (*(uint32_t*)((char*)rs + RSEQ_OFF_CPU_ID)),
+              [base] "r" (percpu_base), [shift] "c" (percpu_shift),
+              [sc] "r" ((uintptr_t)sc), [begin] "r" (percpu_begin[sc])
+            : "rax", "rdx", "memory", "cc");
+        if (status == 0) return p;
+        if (status == 1) return NULL;
+        /* aborted: preempted, migrated or signalled; retry on the new CPU */
+    }
+}
+
+/* push an object of class sc onto the current CPU's slab; 0 when full */
+static inline int percpu_push(void* rs, int sc, void* obj)
+{
+    for (;;){
+        long status;
+        __asm__ __volatile__(
+            ".pushsection __rseq_cs, \"aw\"\n\t"
+            ".balign 32\n\t"
+            "3:\n\t"
+            ".long 0x0, 0x0\n\t"
+            ".quad 1f, (2f - 1f), 4f\n\t"
+            ".popsection\n\t"
+            "movq $1, %[status]\n\t"
+            "leaq 3b(%%rip), %%rax\n\t"
+            "movq %%rax, %[rseq_cs]\n\t"
+            "1:\n\t"
+            "movl %[cpu_id], %%eax\n\t"
+            "shlq %%cl, %%rax\n\t"
+            "addq %[base], %%rax\n\t"
+            "movl (%%rax,%[sc],4), %%edx\n\t"
+            "cmpl %k[end], %%edx\n\t"
+            "je 2f\n\t"
+            "movq %[obj], " PERCPU_STR(PERCPU_HDR_BYTES) "(%%rax,%%rdx,8)\n\t"
+            "addl $1, %%edx\n\t"
+            "movq $0, %[status]\n\t"
+            "movl %%edx, (%%rax,%[sc],4)\n\t"
+            "2:\n\t"
+            ".pushsection __rseq_failure, \"ax\"\n\t"
+            ".byte 0x0f, 0xb9, 0x3d\n\t"
+            ".long " PERCPU_STR(PERCPU_RSEQ_SIG) "\n\t"
+            "4:\n\t"
+            "movq $2, %[status]\n\t"
+            "jmp 2b\n\t"
+            ".popsection\n\t"
+            : [status] "=&r" (status),
+              [rseq_cs] "=m" (*(uint64_t*)((char*)rs + RSEQ_OFF_CS))
+            : [cpu_id] "m" (*(uint32_t*)((char*)rs + RSEQ_OFF_CPU_ID)),
+              [base] "r" (percpu_base), [shift] "c" (percpu_shift),
+              [sc] "r" ((uintptr_t)sc), [end] "r" (percpu_end[sc]), [obj] "r" (obj)
+            : "rax", "rdx", "memory", "cc");
+        if (status == 0) return 1;
+        if (status == 1) return 0;
+    }
+}
+#endif /* PERCPU_SUPPORTED */
+
+#endif /* PERCPU_H */
@@ -0,0 +1,29 @@
+#ifndef SIZE_CLASSES_H
+#define SIZE_CLASSES_H
+#include <stddef.h>
+#include <stdint.h>
+
+#define SIZE_CLASS_COUNT      (96)
+#define SIZE_CLASS_MAX        (256 * 1024)
+#define SIZE_CLASS_PAGE       (4096)   /* unit of SizeClassInfo.pages */
+#define SIZE_CLASS_LOOKUP_LEN (2169)
+
+typedef struct _SizeClassInfo {
+    uint32_t size;   /* slot size in bytes */
+    uint16_t pages;  /* span size in SIZE_CLASS_PAGE units */
+    uint16_t batch;  /* objects moved per thread cache refill/release */
+} SizeClassInfo;
+
+/* tables live in size_classes.c */
+extern const SizeClassInfo size_class_info[SIZE_CLASS_COUNT];
+extern const uint8_t size_class_lookup[SIZE_CLASS_LOOKUP_LEN];
+
+/* sizes <= 1024 are looked up at 8-byte granularity, larger ones at 128;
+ * every class above 1024 is a multiple of 128 so both ranges are exact */
+static inline size_t size_class_lookup_index(size_t size)
+{
+    if (size <= 1024) return (size + 7) >> 3;
+    return (size + 127 + (120 << 7)) >> 7;
+}
+
+#endif /* SIZE_CLASSES_H */
@@ -0,0 +1,96 @@
+#include "../include/dmalloc.h"
+#include "../include/page_heap.h"
+#include <stdint.h>
+
+/* bump arenas for request-scoped data: objects are carved from page heap
+ * spans with no header and never freed one by one; destroy hands every span
+ * back at once. The arena record itself lives in its first span */
+
+#define ARENA_FIRST_PAGES (4)
+#define ARENA_MAX_PAGES   (256)
+
+/* at the start of every span: the link destroy walks */
+typedef struct _ArenaChunk {
+    struct _ArenaChunk* next;
+    Span* span;
+} ArenaChunk;
+
+struct _DmallocArena {
+    uint8_t* cur;
+    uint8_t* end;
+    ArenaChunk* chunks;  /* newest first; the first span is last */
+    size_t next_pages;   /* next bump span, doubling up to ARENA_MAX_PAGES */
+    size_t page_size;
+};
+
+static inline size_t round_up(size_t x, size_t a){ return (x + a - 1) & ~(a - 1); }
+
+#define CHUNK_HDR (round_up(sizeof(ArenaChunk), D_ALIGN))
+
+static ArenaChunk* chunk_new(ArenaChunk* next, size_t pages)
+{
+    Span* s = span_alloc(pages);
+    if (!s) return NULL;
+    ArenaChunk* c = (ArenaChunk*)span_ptr(s);
+    c->next = next;
+    c->span = s;
+    return c;
+}
+
+DmallocArena* dmalloc_arena_create(void)
+{
+    dmalloc_init();
+    ArenaChunk* c = chunk_new(NULL, ARENA_FIRST_PAGES);
+    if (!c) return NULL;
+    DmallocArena* a = (DmallocArena*)((uint8_t*)c + CHUNK_HDR);
+    a->page_size = pageheap_page_size();
+    a->chunks = c;
+    a->cur = (uint8_t*)a + round_up(sizeof(DmallocArena), D_ALIGN);
+    a->end = (uint8_t*)c + span_page_count(c->span) * a->page_size;
+    a->next_pages = ARENA_FIRST_PAGES * 2;
+    return a;
+}
+
+/* the current span is used up: objects over a quarter of a bump span get a
+ * span of their own so the current one keeps its tail */
+static void* arena_refill(DmallocArena* a, size_t size)
+{
+    size_t ps = a->page_size;
+    if (size > a->next_pages * ps / 4){
+        if (size > SIZE_MAX - CHUNK_HDR - ps) return NULL;
+        ArenaChunk* c = chunk_new(a->chunks, (CHUNK_HDR + size + ps - 1) / ps);
+        if (!c) return NULL;
+        a->chunks = c;
+        return (uint8_t*)c + CHUNK_HDR;
+    }
+    ArenaChunk* c = chunk_new(a->chunks, a->next_pages);
+    if (!c) return NULL;
+    a->chunks = c;
+    a->cur = (uint8_t*)c + CHUNK_HDR + size;
+    a->end = (uint8_t*)c + span_page_count(c->span) * ps;
+    if (a->next_pages < ARENA_MAX_PAGES) a->next_pages *= 2;
+    return (uint8_t*)c + CHUNK_HDR;
+}
+
+void* dmalloc_arena_alloc(DmallocArena* a, size_t size)
+{
+    if (size > SIZE_MAX - D_ALIGN) return NULL;
+    size = size ? round_up(size, D_ALIGN) : D_ALIGN;
+    if (__builtin_expect(size <= (size_t)(a->end - a->cur), 1)){
+        void* p = a->cur;
+        a->cur += size;
+        return p;
+    }
+    return arena_refill(a, size);
+}
+
+void dmalloc_arena_destroy(DmallocArena* a)
+{
+    if (!a) return;
+    ArenaChunk* c = a->chunks;
+    while (c){
+        ArenaChunk* next = c->next;
+        span_free(c->span);
+        c = next;
+    }
+}
@@ -1,45 +1,134 @@
+#define _GNU_SOURCE /* mremap */
 #include "../include/dmalloc.h"
 #include "../include/page_heap.h"
 #include <stdint.h>
 #include <string.h>
 #include <stdatomic.h>
 #include <pthread.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <sys/mman.h>
+#include <time.h>
 
 
 
 #define CENTRAL_SHARDS 64
-static CentralFreeList central[ CENTRAL_SHARDS ][ (MAX_SMALL / D_ALIGN) ];
-static pthread_mutex_t central_lock[ CENTRAL_SHARDS ][ (MAX_SMALL / D_ALIGN) ];
+static CentralFreeList central[ CENTRAL_SHARDS ][ SIZE_CLASS_COUNT ];
+static pthread_mutex_t central_lock[ CENTRAL_SHARDS ][ SIZE_CLASS_COUNT ];
 /* optional stats */
 #ifdef DMALLOC_STATS
-static atomic_ulong stat_fetch_tries[ CENTRAL_SHARDS ][ (MAX_SMALL / D_ALIGN) ];
-static atomic_ulong stat_fetch_batches[ CENTRAL_SHARDS ][ (MAX_SMALL / D_ALIGN) ];
+static atomic_ulong stat_fetch_tries[ CENTRAL_SHARDS ][ SIZE_CLASS_COUNT ];
+static atomic_ulong stat_fetch_batches[ CENTRAL_SHARDS ][ SIZE_CLASS_COUNT ];
 #endif
-static __thread ThreadCache* tls_tc;
+/* cross-shard frees: lock-free stacks drained in batches by the owning shard */
+typedef struct {
+    _Atomic(void*) head;
+    atomic_size_t  count;
+    char pad[64 - sizeof(void*) - sizeof(size_t)];
+} RemoteFreeList;
+static RemoteFreeList central_remote[ CENTRAL_SHARDS ][ SIZE_CLASS_COUNT ];
+/* transfer cache: whole batches parked between thread caches and the central
+ * lists. A batch is a chain of exactly size_class_info[sc].batch slots linked
+ * through their first word and a slot holds its head, so a flush or refill is
+ * one CAS/exchange on a slot: no lock, and the chain is never walked here */
+#define TRANSFER_SLOTS 16
+#define TRANSFER_BYTES (256 * 1024) /* per shard and class, at least one batch */
+typedef struct {
+    _Atomic(void*) slots[ TRANSFER_SLOTS ];
+    atomic_int used;  /* pushed or popped since the last idle drain */
+} __attribute__((aligned(64))) TransferCache;
+static TransferCache transfer[ CENTRAL_SHARDS ][ SIZE_CLASS_COUNT ];
+DMALLOC_TLS ThreadCache* dmalloc_tls_tc;
+#ifdef PERCPU_SUPPORTED
+DMALLOC_TLS void* dmalloc_tls_rseq;
+#endif
+/* thread exit hook and pool of ThreadCaches left behind by exited threads */
+static pthread_key_t tc_key;
+static ThreadCache* tc_pool;
+static pthread_mutex_t tc_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static void tc_thread_exit(void* arg);
+/* live thread caches and where the next steal starts looking; under tc_pool_lock */
+static ThreadCache* tc_live;
+static ThreadCache* tc_steal_next;
+static size_t tc_live_count;
+/* capacity claimed from DMALLOC_TCACHE_BUDGET: the sum over live caches of
+ * capacity - owed */
+static atomic_size_t tcache_budget_used = ATOMIC_VAR_INIT(0);
+#define TCACHE_START 16            /* first max of a list, if a batch is larger */
+#define TCACHE_MAX_BATCHES 8       /* max never grows past this many batches */
+#define TCACHE_SHRINK_OVERFLOWS 4  /* flushes at a steady max before it drops a batch */
+/* objects released to central; drives the periodic soft reclaim */
 static atomic_ulong dfree_counter = ATOMIC_VAR_INIT(0);
+#define DFREE_MADVISE_SHIFT 27
+/* background scavenger; scav_running also switches off the inline madvise */
+#define SCAVENGE_INTERVAL_MS 100
+static atomic_int scav_running = ATOMIC_VAR_INIT(0);
+static size_t scav_rate;
+static pthread_t scav_thread;
+static pthread_mutex_t scav_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t scav_cond = PTHREAD_COND_INITIALIZER;
+/* page size cached by dmalloc_init(); 0 until then */
+static size_t page_size;
 
-static inline size_t tcache_max(void){ return 512; }
-static inline size_t tcache_refill_batch_for_sc(int sc){
-    size_t obj = central[0][sc].obj_size;
-    if (obj <= 64) return 1024;
-    if (obj <= 256) return 512;
-    return 256;
-}
-static inline size_t tcache_release_batch(void){ return 512; }
+/* per-class batch comes from the size class table; a thread list's max
+ * adapts between 0 and TCACHE_MAX_BATCHES batches (see tcache_grow) */
+static inline size_t tcache_refill_batch_for_sc(int sc){ return size_class_info[sc].batch; }
+static inline size_t tcache_release_batch(int sc){ return size_class_info[sc].batch; }
 
 static inline size_t round_up(size_t x, size_t a){ return (x + a - 1) & ~(a - 1); }
 
+/* batches a transfer cache keeps for sc */
+static inline int transfer_cap(int sc){
+    size_t b = TRANSFER_BYTES / ((size_t)size_class_info[sc].batch * size_class_info[sc].size);
+    return b < 1 ? 1 : b > TRANSFER_SLOTS ? TRANSFER_SLOTS : (int)b;
+}
+
 static inline int size_class_for(size_t size){
-    if (size == 0) size = 1;
-    size_t need = round_up(size, D_ALIGN);
-    if (need > MAX_SMALL) return -1;
-    return (int)(need / D_ALIGN) - 1;
+    if (size > MAX_SMALL) return -1;
+    return size_class_lookup[size_class_lookup_index(size)];
 }
 
 static inline size_t obj_header_size(void){ return round_up(sizeof(ObjHdr), D_ALIGN); }
-static inline size_t small_span_header_size(void){ return round_up(sizeof(SmallSpan), D_ALIGN); }
+
+/* SmallSpan metadata lives out of band so slots start at the span base */
+#define SMALL_META_CHUNK (256)
+static SmallSpan* small_meta_free;
+static pthread_mutex_t small_meta_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static SmallSpan* small_span_new(void)
+{
+    pthread_mutex_lock(&small_meta_lock);
+    if (!small_meta_free){
+        size_t sz = SMALL_META_CHUNK * sizeof(SmallSpan);
+        void* mem = mmap(NULL, sz, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED){ pthread_mutex_unlock(&small_meta_lock); return NULL; }
+        SmallSpan* arr = (SmallSpan*)mem;
+        for (size_t i = 0; i < SMALL_META_CHUNK; i++){
+            arr[i].next_meta = small_meta_free;
+            small_meta_free = &arr[i];
+        }
+    }
+    SmallSpan* ss = small_meta_free;
+    small_meta_free = ss->next_meta;
+    pthread_mutex_unlock(&small_meta_lock);
+    memset(ss, 0, sizeof(SmallSpan));
+    return ss;
+}
+
+static void small_span_delete(SmallSpan* ss)
+{
+    pthread_mutex_lock(&small_meta_lock);
+    ss->next_meta = small_meta_free;
+    small_meta_free = ss;
+    pthread_mutex_unlock(&small_meta_lock);
+}
+
+/* resolve the SmallSpan of a slot through the pagemap; NULL for large/direct */
+static inline SmallSpan* small_span_of(const void* p)
+{
+    Span* sp = pageheap_span_of(p);
+    return sp ? (SmallSpan*)sp->owner : NULL;
+}
 
 static inline uint32_t hash32(uintptr_t x){
     x ^= x >> 16;
@@ -50,13 +139,50 @@ static inline uint32_t hash32(uintptr_t x){
     return (uint32_t)x;
 }
 static inline int shard_index(void){
-    if (tls_tc && tls_tc->shard_id >= 0) return tls_tc->shard_id;
-    uintptr_t h = (uintptr_t)tls_tc;
+#ifdef PERCPU_SUPPORTED
+    /* per-CPU mode: threads on the same CPU share a shard */
+    if (dmalloc_tls_rseq) return percpu_cpu(dmalloc_tls_rseq) & (CENTRAL_SHARDS - 1);
+#endif
+    if (dmalloc_tls_tc && dmalloc_tls_tc->shard_id >= 0) return dmalloc_tls_tc->shard_id;
+    uintptr_t h = (uintptr_t)dmalloc_tls_tc;
     if (!h) h = (uintptr_t)pthread_self();
     uint32_t v = hash32(h);
     return (int)(v & (CENTRAL_SHARDS - 1));
 }
 
+/* fork: the forking thread takes every allocator lock in a fixed order so the
+ * child never inherits one mid-update, then both sides release them. No lock
+ * is taken while another is held, so any order is deadlock free */
+static void dmalloc_fork_prepare(void)
+{
+    pthread_mutex_lock(&scav_lock);
+    pthread_mutex_lock(&tc_pool_lock);
+    for (size_t s = 0; s < CENTRAL_SHARDS; s++)
+        for (size_t i = 0; i < SIZE_CLASS_COUNT; i++)
+            pthread_mutex_lock(&central_lock[s][i]);
+    pthread_mutex_lock(&small_meta_lock);
+    pageheap_fork_prepare();
+}
+
+static void dmalloc_fork_parent(void)
+{
+    pageheap_fork_release();
+    pthread_mutex_unlock(&small_meta_lock);
+    for (size_t s = CENTRAL_SHARDS; s-- > 0;)
+        for (size_t i = SIZE_CLASS_COUNT; i-- > 0;)
+            pthread_mutex_unlock(&central_lock[s][i]);
+    pthread_mutex_unlock(&tc_pool_lock);
+    pthread_mutex_unlock(&scav_lock);
+}
+
+/* the scavenger thread is not copied into the child */
+static void dmalloc_fork_child(void)
+{
+    atomic_store_explicit(&scav_running, 0, memory_order_relaxed);
+    pthread_cond_init(&scav_cond, NULL);
+    dmalloc_fork_parent();
+}
+
 static void central_init_once(void)
 {
     /* init_state: 0=uninitialized, 1=initializing, 2=initialized */
@@ -66,12 +192,18 @@ static void central_init_once(void)
                                                memory_order_acq_rel, memory_order_acquire)){
         /* we won the initialization */
         for (size_t s = 0; s < CENTRAL_SHARDS; s++){
-            for (size_t i = 0; i < (MAX_SMALL / D_ALIGN); i++){
-                central[s][i].head = NULL;
-                central[s][i].obj_size = (i + 1) * D_ALIGN;
+            for (size_t i = 0; i < SIZE_CLASS_COUNT; i++){
+                memset(&central[s][i], 0, sizeof(CentralFreeList));
+                central[s][i].obj_size = size_class_info[i].size;
                 pthread_mutex_init(&central_lock[s][i], NULL);
             }
         }
+        pthread_key_create(&tc_key, tc_thread_exit);
+        pthread_atfork(dmalloc_fork_prepare, dmalloc_fork_parent, dmalloc_fork_child);
+#ifdef PERCPU_SUPPORTED
+        /* on failure percpu_register() returns NULL and threads keep their caches */
+        percpu_init();
+#endif
         atomic_store_explicit(&init_state, 2, memory_order_release);
         return;
     }
@@ -81,70 +213,196 @@ static void central_init_once(void)
     }
 }
 
+static inline int occupancy_bin(const SmallSpan* ss)
+{
+    return (int)(((ss->total_objs - ss->free_objs) * CENTRAL_OCC_BINS) / ss->total_objs);
+}
+
+static void bin_insert(CentralFreeList* c, SmallSpan* ss, int bin)
+{
+    ss->bin = bin;
+    ss->prev = NULL;
+    ss->next = c->bins[bin];
+    if (ss->next) ss->next->prev = ss;
+    c->bins[bin] = ss;
+    c->nonempty |= 1u << bin;
+}
+
+static void bin_remove(CentralFreeList* c, SmallSpan* ss)
+{
+    int bin = ss->bin;
+    if (ss->prev) ss->prev->next = ss->next; else c->bins[bin] = ss->next;
+    if (ss->next) ss->next->prev = ss->prev;
+    if (!c->bins[bin]) c->nonempty &= ~(1u << bin);
+    ss->next = ss->prev = NULL;
+    ss->bin = -1;
+}
+
+/* move a span to the bin matching its occupancy; full spans leave the bins */
+static void central_rebin(CentralFreeList* c, SmallSpan* ss)
+{
+    int bin = ss->free_objs ? occupancy_bin(ss) : -1;
+    if (bin == ss->bin) return;
+    if (ss->bin >= 0) bin_remove(c, ss);
+    if (bin >= 0) bin_insert(c, ss, bin);
+}
+
 static void central_grow(int sc, int shard)
 {
-    size_t ps = pageheap_page_size();
-    size_t payload = central[0][sc].obj_size;
-    size_t hdr = obj_header_size();
-    size_t slot = hdr + payload;
-    size_t span_hdr = small_span_header_size();
+    size_t ps = page_size;
+    size_t slot = central[0][sc].obj_size;
 
-    /* choose pages so that we have at least TARGET objects */
-    size_t npages = 1;
-    const size_t TARGET = 512;
-    while ((npages * ps) < (span_hdr + slot)) npages++;
-    while (((npages * ps) - span_hdr) / slot < TARGET) npages++;
+    /* span size is fixed per class by the size class table */
+    size_t span_bytes = (size_t)size_class_info[sc].pages * SIZE_CLASS_PAGE;
+    size_t npages = (span_bytes + ps - 1) / ps;
 
     Span* sp = span_alloc(npages);
     if (!sp) return;
     uint8_t* base = (uint8_t*)span_ptr(sp);
     size_t   bytes = span_page_count(sp) * ps;
 
-    /* place SmallSpan header at the beginning of span */
-    SmallSpan* ss = (SmallSpan*)base;
+    SmallSpan* ss = small_span_new();
+    if (!ss){
+        span_free(sp);
+        return;
+    }
     ss->size_class = (size_t)sc;
-    ss->total_objs = 0;
-    ss->free_objs  = 0;
+    ss->shard = shard;
+    ss->bin = -1;
+    ss->span = sp;
+    /* publish before any slot escapes so dfree can resolve it */
+    sp->owner = ss;
 
-    size_t offset = span_hdr;
-    size_t capacity = (bytes > offset) ? ((bytes - offset) / slot) : 0;
-    if (capacity == 0){
-        /* pathological: release span and bail */
-        span_free(sp);
+    /* no slot is touched here; fetches carve from the bump pointer */
+    size_t capacity = bytes / slot;
+    ss->bump = base;
+    ss->bump_end = base + capacity * slot;
+    ss->total_objs = capacity;
+    ss->free_objs = capacity;
+    pthread_mutex_lock(&central_lock[shard][sc]);
+    central[shard][sc].count += capacity;
+    central_rebin(&central[shard][sc], ss);
+    pthread_mutex_unlock(&central_lock[shard][sc]);
+}
+
+/* return one slot to its span; caller holds the span's shard lock. A span that
+ * becomes fully free is queued on *empty for the page heap as long as the
+ * shard keeps another span's worth of free slots */
+static void central_return_locked(CentralFreeList* c, SmallSpan* ss, void* ptr, SmallSpan** empty)
+{
+    *(void**)ptr = ss->freelist;
+    ss->freelist = ptr;
+    ss->free_objs++;
+    c->count++;
+    if (ss->free_objs == ss->total_objs && c->count >= 2 * ss->total_objs){
+        if (ss->bin >= 0) bin_remove(c, ss);
+        c->count -= ss->total_objs;
+        ss->next_meta = *empty;
+        *empty = ss;
         return;
     }
+    central_rebin(c, ss);
+}
 
-    void* chain = NULL;
-    for (size_t i = 0; i < capacity; i++){
-        uint8_t* p = base + offset + i * slot;
-        ObjHdr* h = (ObjHdr*)p;
-        h->owner = (void*)ss;
-        h->size_class = (uint16_t)sc;
-        h->flags = 0;
-        void* user = (void*)(p + hdr);
-        *(void**)user = chain;
-        chain = user;
-        ss->total_objs++;
-        ss->free_objs++;
+/* give spans collected by central_return_locked back; call without locks held */
+static void central_free_empty(SmallSpan* empty)
+{
+    while (empty){
+        SmallSpan* ss = empty;
+        empty = ss->next_meta;
+        span_free(ss->span);
+        small_span_delete(ss);
     }
-    pthread_mutex_lock(&central_lock[shard][sc]);
-    while (chain){
-        void* u = chain;
-        chain = *(void**)u;
-        *(void**)u = central[shard][sc].head;
-        central[shard][sc].head = u;
+}
+
+/* splice everything other shards freed into our spans; caller holds the lock */
+static void central_drain_remote(int shard, int sc, SmallSpan** empty)
+{
+    RemoteFreeList* r = &central_remote[shard][sc];
+    if (!atomic_load_explicit(&r->head, memory_order_relaxed)) return;
+    void* p = atomic_exchange_explicit(&r->head, NULL, memory_order_acquire);
+    size_t n = 0;
+    while (p){
+        void* next = *(void**)p;
+        central_return_locked(&central[shard][sc], small_span_of(p), p, empty);
+        p = next;
+        n++;
     }
-    pthread_mutex_unlock(&central_lock[shard][sc]);
+    atomic_fetch_sub_explicit(&r->count, n, memory_order_relaxed);
+}
+
+/* push a slot owned by another shard; once a batch has piled up the freeing
+ * thread drains it itself if the owner's lock happens to be free */
+static void remote_free(SmallSpan* ss, void* ptr)
+{
+    int shard = ss->shard;
+    int sc = (int)ss->size_class;
+    RemoteFreeList* r = &central_remote[shard][sc];
+    void* head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    do {
+        *(void**)ptr = head;
+    } while (!atomic_compare_exchange_weak_explicit(&r->head, &head, ptr,
+                                                    memory_order_release, memory_order_relaxed));
+    size_t n = atomic_fetch_add_explicit(&r->count, 1, memory_order_relaxed) + 1;
+    if (n >= size_class_info[sc].batch && pthread_mutex_trylock(&central_lock[shard][sc]) == 0){
+        SmallSpan* empty = NULL;
+        central_drain_remote(shard, sc, &empty);
+        pthread_mutex_unlock(&central_lock[shard][sc]);
+        central_free_empty(empty);
+    }
+}
+
+static inline void transfer_touch(TransferCache* t)
+{
+    if (!atomic_load_explicit(&t->used, memory_order_relaxed))
+        atomic_store_explicit(&t->used, 1, memory_order_relaxed);
+}
+
+/* park a full batch chain; 0 when the cache is at capacity */
+static int transfer_push(int shard, int sc, void* head)
+{
+    TransferCache* t = &transfer[shard][sc];
+    int cap = transfer_cap(sc);
+    for (int i = 0; i < cap; i++){
+        void* expected = NULL;
+        if (atomic_load_explicit(&t->slots[i], memory_order_relaxed)) continue;
+        if (atomic_compare_exchange_strong_explicit(&t->slots[i], &expected, head,
+                                                    memory_order_release, memory_order_relaxed)){
+            transfer_touch(t);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* take a parked batch chain; NULL when empty */
+static void* transfer_pop(int shard, int sc)
+{
+    TransferCache* t = &transfer[shard][sc];
+    int cap = transfer_cap(sc);
+    for (int i = 0; i < cap; i++){
+        if (!atomic_load_explicit(&t->slots[i], memory_order_relaxed)) continue;
+        void* head = atomic_exchange_explicit(&t->slots[i], NULL, memory_order_acquire);
+        if (head){
+            transfer_touch(t);
+            return head;
+        }
+    }
+    return NULL;
 }
 
+/* hand out slots from the fullest spans first so sparse spans can drain */
 static size_t central_fetch_batch(int sc, void** out, size_t n)
 {
     size_t got = 0;
     int shard = shard_index();
+    CentralFreeList* c = &central[shard][sc];
+    SmallSpan* empty = NULL;
     pthread_mutex_lock(&central_lock[shard][sc]);
-    if (!central[shard][sc].head){
+    central_drain_remote(shard, sc, &empty);
+    if (!c->nonempty){
         int tries = 0;
-        while (!central[shard][sc].head && tries < 3){
+        while (!c->nonempty && tries < 3){
             pthread_mutex_unlock(&central_lock[shard][sc]);
             central_grow(sc, shard);
             pthread_mutex_lock(&central_lock[shard][sc]);
@@ -154,45 +412,99 @@ static size_t central_fetch_batch(int sc, void** out, size_t n)
         atomic_fetch_add_explicit(&stat_fetch_tries[shard][sc], tries, memory_order_relaxed);
         #endif
     }
-    while (central[shard][sc].head && got < n){
-        void* user = central[shard][sc].head;
-        __builtin_prefetch(*(void**)user, 0, 1);
-        central[shard][sc].head = *(void**)user;
-        ObjHdr* h = (ObjHdr*)((uint8_t*)user - obj_header_size());
-        SmallSpan* ss = (SmallSpan*)h->owner;
-        if (__builtin_expect(!!ss, 1)) ss->free_objs--;
-        out[got++] = user;
+    while (c->nonempty && got < n){
+        int bin = 31 - __builtin_clz(c->nonempty);
+        SmallSpan* ss = c->bins[bin];
+        size_t before = got;
+        while (ss->freelist && got < n){
+            void* user = ss->freelist;
+            ss->freelist = *(void**)user;
+            out[got++] = user;
+        }
+        while (ss->bump < ss->bump_end && got < n){
+            out[got++] = ss->bump;
+            ss->bump += c->obj_size;
+        }
+        ss->free_objs -= got - before;
+        c->count -= got - before;
+        central_rebin(c, ss);
     }
     #ifdef DMALLOC_STATS
     if (got) atomic_fetch_add_explicit(&stat_fetch_batches[shard][sc], 1, memory_order_relaxed);
     #endif
     pthread_mutex_unlock(&central_lock[shard][sc]);
+    central_free_empty(empty);
     return got;
 }
 
+/* objects always return to their own span in the shard that carved it, so
+ * span state is only ever touched under one lock */
 static void central_release_batch(int sc, void** list, size_t n)
 {
-    int shard = shard_index();
-    pthread_mutex_lock(&central_lock[shard][sc]);
+    SmallSpan* empty = NULL;
+    int locked = -1;
     for (size_t i = 0; i < n; i++){
         void* ptr = list[i];
-        *(void**)ptr = central[shard][sc].head;
-        central[shard][sc].head = ptr;
-        ObjHdr* h = (ObjHdr*)((uint8_t*)ptr - obj_header_size());
-        SmallSpan* ss = (SmallSpan*)h->owner;
-        if (ss) ss->free_objs++;
+        SmallSpan* ss = small_span_of(ptr);
+        int shard = ss->shard;
+        if (shard != locked){
+            if (locked >= 0) pthread_mutex_unlock(&central_lock[locked][sc]);
+            pthread_mutex_lock(&central_lock[shard][sc]);
+            central_drain_remote(shard, sc, &empty);
+            locked = shard;
+        }
+        central_return_locked(&central[shard][sc], ss, ptr, &empty);
     }
-    pthread_mutex_unlock(&central_lock[shard][sc]);
+    if (locked >= 0) pthread_mutex_unlock(&central_lock[locked][sc]);
+    central_free_empty(empty);
 }
 
+/* hand parked batches back to central so their spans can empty; with
+ * idle_only a cache used since the previous idle drain is kept. Returns the
+ * objects released */
+static size_t transfer_drain(int idle_only)
+{
+    size_t n = 0;
+    for (int shard = 0; shard < CENTRAL_SHARDS; shard++){
+        for (int sc = 0; sc < SIZE_CLASS_COUNT; sc++){
+            TransferCache* t = &transfer[shard][sc];
+            if (idle_only && atomic_load_explicit(&t->used, memory_order_relaxed)){
+                atomic_store_explicit(&t->used, 0, memory_order_relaxed);
+                continue;
+            }
+            void* tmp[ size_class_info[sc].batch ];
+            for (int i = 0; i < TRANSFER_SLOTS; i++){
+                if (!atomic_load_explicit(&t->slots[i], memory_order_relaxed)) continue;
+                void* head = atomic_exchange_explicit(&t->slots[i], NULL, memory_order_acquire);
+                size_t k = 0;
+                while (head){
+                    tmp[k++] = head;
+                    head = *(void**)head;
+                }
+                if (k) central_release_batch(sc, tmp, k);
+                n += k;
+            }
+        }
+    }
+    return n;
+}
 
 static ThreadCache* tc_get(void)
 {
-    ThreadCache* tc = tls_tc;
+    ThreadCache* tc = dmalloc_tls_tc;
     if (!tc){
-        void* mem = mmap(NULL, sizeof(ThreadCache), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-        if (mem == MAP_FAILED) return NULL;
-        tc = (ThreadCache*)mem;
+        /* first touch of this thread; covers callers that run before our constructor */
+        dmalloc_init();
+        pthread_mutex_lock(&tc_pool_lock);
+        tc = tc_pool;
+        if (tc) tc_pool = (ThreadCache*)tc->next_free;
+        pthread_mutex_unlock(&tc_pool_lock);
+        if (!tc){
+            void* mem = mmap(NULL, sizeof(ThreadCache), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (mem == MAP_FAILED) return NULL;
+            tc = (ThreadCache*)mem;
+        }
+        /* lists start with max 0 and grow on demand */
         memset(tc, 0, sizeof(ThreadCache));
         size_t pages[LARGE_BUCKET_COUNT] = {4,6,8,9,10,12,16,20,24,32,48,64,96,128,192,256};
         for (int i = 0; i < LARGE_BUCKET_COUNT; i++){
@@ -205,50 +517,374 @@ static ThreadCache* tc_get(void)
         uintptr_t h = (uintptr_t)tc;
         if (!h) h = (uintptr_t)pthread_self();
         tc->shard_id = (int)(hash32(h) & (CENTRAL_SHARDS - 1));
-        tls_tc = tc;
+        pthread_mutex_lock(&tc_pool_lock);
+        tc->next_live = tc_live;
+        tc_live = tc;
+        tc_live_count++;
+        pthread_mutex_unlock(&tc_pool_lock);
+        dmalloc_tls_tc = tc;
+#ifdef PERCPU_SUPPORTED
+        /* small objects move to the per-CPU slabs from here on; the thread
+         * cache still serves large buckets and the rseq-less fallback */
+        dmalloc_tls_rseq = percpu_register();
+#endif
+        /* arms tc_thread_exit for this thread */
+        pthread_setspecific(tc_key, tc);
     }
     return tc;
 }
 
-void* dmalloc(size_t size)
+/* pthread key destructor: hand cached objects back and recycle the cache */
+static void tc_thread_exit(void* arg)
 {
-    central_init_once();
-    int sc = size_class_for(size);
-    if (sc < 0){
-        if (!pageheap_page_size()) pageheap_init();
-        size_t ps = pageheap_page_size();
-        size_t need = round_up(size + obj_header_size(), D_ALIGN);
-        size_t npages = (need + ps - 1) / ps;
-        ThreadCache* tc = tc_get();
-        if (tc){
-            for (int i = 0; i < LARGE_BUCKET_COUNT; i++){
-                LargeBucket* lb = &tc->lbuckets[i];
-                if (lb->pages == npages && lb->head){
-                    ObjHdr* h = (ObjHdr*)lb->head;
-                    lb->head = ((ObjHdr*)lb->head)->owner;
-                    if (lb->count) lb->count--;
-                    h->owner = NULL;
-                    h->size_class = npages;
-                    h->flags = (OBJ_FLAG_LARGE | OBJ_FLAG_DIRECT);
-                    return (void*)((uint8_t*)h + obj_header_size());
-                }
+    ThreadCache* tc = (ThreadCache*)arg;
+    dmalloc_tls_tc = NULL;
+    /* out of reach of stealers first, so owed is final below */
+    pthread_mutex_lock(&tc_pool_lock);
+    ThreadCache** pp = &tc_live;
+    while (*pp != tc) pp = (ThreadCache**)&(*pp)->next_live;
+    *pp = tc->next_live;
+    if (tc_steal_next == tc) tc_steal_next = tc->next_live;
+    tc_live_count--;
+    pthread_mutex_unlock(&tc_pool_lock);
+    for (int sc = 0; sc < SIZE_CLASS_COUNT; sc++){
+        TCacheList* list = &tc->lists[sc];
+        size_t batch = tcache_release_batch(sc);
+        void* tmp[ batch ];
+        while (list->head){
+            size_t n = 0;
+            while (list->head && n < batch){
+                void* p = list->head;
+                list->head = *(void**)p;
+                tmp[n++] = p;
             }
+            central_release_batch(sc, (void**)tmp, n);
         }
-        size_t bytes = npages * ps;
-        void* mem = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-        if (mem == MAP_FAILED) return NULL;
-        uint8_t* base = (uint8_t*)mem;
-        ObjHdr* h = (ObjHdr*)base;
-        h->owner = NULL;
-        h->size_class = npages;
-        h->flags = (OBJ_FLAG_LARGE | OBJ_FLAG_DIRECT);
-        return (void*)(base + obj_header_size());
+        list->count = 0;
     }
+    for (int i = 0; i < LARGE_BUCKET_COUNT; i++){
+        LargeBucket* lb = &tc->lbuckets[i];
+        while (lb->head){
+            ObjHdr* h = (ObjHdr*)lb->head;
+            lb->head = *(void**)((uint8_t*)h + obj_header_size());
+            span_free((Span*)h->owner);
+        }
+        lb->count = 0;
+    }
+    /* the budget gets our capacity back, less what stealers already hold */
+    size_t cap = atomic_load_explicit(&tc->capacity, memory_order_relaxed);
+    size_t owed = atomic_load_explicit(&tc->owed, memory_order_relaxed);
+    if (cap > owed) atomic_fetch_sub_explicit(&tcache_budget_used, cap - owed, memory_order_relaxed);
+    else atomic_fetch_add_explicit(&tcache_budget_used, owed - cap, memory_order_relaxed);
+    pthread_mutex_lock(&tc_pool_lock);
+    tc->next_free = tc_pool;
+    tc_pool = tc;
+    pthread_mutex_unlock(&tc_pool_lock);
+}
+
+/* large objects below DMALLOC_DIRECT_THRESHOLD are carved from the page heap;
+ * the ObjHdr at the span start points back at the Span. *zeroed (if given)
+ * reports whether the payload is known to read as zero */
+static void* large_alloc(size_t npages, int* zeroed)
+{
+    ThreadCache* tc = tc_get();
+    if (tc){
+        for (int i = 0; i < LARGE_BUCKET_COUNT; i++){
+            LargeBucket* lb = &tc->lbuckets[i];
+            if (lb->pages == npages && lb->head){
+                /* cached blocks keep their header; the link lives in the payload */
+                ObjHdr* h = (ObjHdr*)lb->head;
+                void* user = (void*)((uint8_t*)h + obj_header_size());
+                lb->head = *(void**)user;
+                if (lb->count) lb->count--;
+                if (zeroed) *zeroed = 0;
+                return user;
+            }
+        }
+    }
+    Span* sp = span_alloc(npages);
+    if (!sp) return NULL;
+    if (zeroed) *zeroed = (int)sp->zeroed;
+    ObjHdr* h = (ObjHdr*)span_ptr(sp);
+    h->owner = sp;
+    h->size_class = npages;
+    h->flags = OBJ_FLAG_LARGE;
+    return (void*)((uint8_t*)h + obj_header_size());
+}
+
+static void large_free(ObjHdr* h)
+{
+    Span* sp = (Span*)h->owner;
+    size_t npages = span_page_count(sp);
+    ThreadCache* tc = tc_get();
+    if (tc){
+        for (int i = 0; i < LARGE_BUCKET_COUNT; i++){
+            LargeBucket* lb = &tc->lbuckets[i];
+            if (lb->pages == npages && lb->count < lb->target){
+                void* user = (void*)((uint8_t*)h + obj_header_size());
+                *(void**)user = lb->head;
+                lb->head = h;
+                lb->count++;
+                return;
+            }
+        }
+    }
+    span_free(sp);
+}
+
+/* huge objects get their own mapping and go straight back to the OS */
+static void* direct_alloc(size_t npages)
+{
+    size_t bytes = npages * page_size;
+    void* mem = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) return NULL;
+    uint8_t* base = (uint8_t*)mem;
+    ObjHdr* h = (ObjHdr*)base;
+    h->owner = base;
+    h->size_class = npages;
+    h->flags = (OBJ_FLAG_LARGE | OBJ_FLAG_DIRECT);
+    return (void*)(base + obj_header_size());
+}
+
+/* map [align-aligned payload of npages, preceded by one page for the header];
+ * the slack of the over-sized reservation is unmapped again */
+static void* direct_alloc_aligned(size_t npages, size_t align)
+{
+    size_t ps = page_size;
+    size_t bytes = (npages + 1) * ps;
+    if (bytes > SIZE_MAX - align) return NULL;
+    void* mem = mmap(NULL, bytes + align, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) return NULL;
+    uint8_t* raw = (uint8_t*)mem;
+    uint8_t* user = (uint8_t*)round_up((uintptr_t)raw + ps, align);
+    uint8_t* base = user - ps;
+    if (base > raw) munmap(raw, (size_t)(base - raw));
+    uint8_t* end = base + bytes;
+    if (raw + bytes + align > end) munmap(end, (size_t)(raw + bytes + align - end));
+    ObjHdr* h = (ObjHdr*)(user - obj_header_size());
+    h->owner = base;
+    h->size_class = npages + 1;
+    h->flags = (OBJ_FLAG_LARGE | OBJ_FLAG_DIRECT);
+    return user;
+}
+
+/* anything above MAX_SMALL: page heap span or, past the threshold, a mapping */
+static void* big_alloc(size_t size, int* zeroed)
+{
+    size_t ps = page_size;
+    if (__builtin_expect(!ps, 0)){
+        dmalloc_init();
+        ps = page_size;
+    }
+    if (size > SIZE_MAX - obj_header_size() - ps) return NULL;
+    size_t need = round_up(size + obj_header_size(), D_ALIGN);
+    size_t npages = (need + ps - 1) / ps;
+    if (size > DMALLOC_DIRECT_THRESHOLD){
+        if (zeroed) *zeroed = 1;
+        return direct_alloc(npages);
+    }
+    return large_alloc(npages, zeroed);
+}
+
+/* header of a large or direct object. span-backed objects carry it at the span
+ * start; spans handed out by dmalloc_aligned start with the payload instead
+ * and have none (NULL). direct objects keep it right before ptr */
+static ObjHdr* large_header_of(void* ptr)
+{
+    Span* sp = pageheap_span_of(ptr);
+    if (!sp) return (ObjHdr*)((uint8_t*)ptr - obj_header_size());
+    if (span_ptr(sp) == ptr) return NULL;
+    return (ObjHdr*)span_ptr(sp);
+}
+
+void* dmalloc(size_t size)
+{
+    return dmalloc_inline(size);
+}
+
+/* every 2^DFREE_MADVISE_SHIFT objects released to central, soft-reclaim idle spans */
+static void note_central_release(size_t n)
+{
+    if (atomic_load_explicit(&scav_running, memory_order_relaxed)) return;
+    unsigned long c = atomic_fetch_add_explicit(&dfree_counter, n, memory_order_relaxed);
+    if (((c + n) >> DFREE_MADVISE_SHIFT) != (c >> DFREE_MADVISE_SHIFT)){
+        transfer_drain(1);
+        pageheap_madvise_idle_spans(32);
+    }
+}
+
+#ifdef PERCPU_SUPPORTED
+/* this CPU's slab is empty for sc: fetch a batch, keep one, stash the rest */
+static void* percpu_refill(void* rs, int sc)
+{
+    /* another thread on this CPU may have refilled in the meantime */
+    void* p = percpu_pop(rs, sc);
+    if (p) return p;
+    size_t batch = tcache_refill_batch_for_sc(sc);
+    void* tmp[ batch ];
+    size_t got = central_fetch_batch(sc, tmp, batch);
+    if (!got) return NULL;
+    size_t i = 1;
+    while (i < got && percpu_push(rs, sc, tmp[i])) i++;
+    /* we may have migrated onto a CPU whose slab is full */
+    if (i < got) central_release_batch(sc, tmp + i, got - i);
+    return tmp[0];
+}
+
+/* this CPU's slab is full for sc: send ptr and a batch of cached objects back */
+static void percpu_overflow(void* rs, int sc, void* ptr)
+{
+    size_t batch = tcache_release_batch(sc);
+    void* tmp[ batch ];
+    size_t n = 0;
+    tmp[n++] = ptr;
+    while (n < batch && (tmp[n] = percpu_pop(rs, sc)) != NULL) n++;
+    central_release_batch(sc, tmp, n);
+    note_central_release(n);
+}
+#endif
+
+/* cut up to n objects (at most a batch) off the front of a thread list; a full
+ * batch of our own shard is parked in the transfer cache if there is room,
+ * the rest goes back to central, which returns each object to its owner */
+static void tcache_flush(ThreadCache* tc, int sc, size_t n)
+{
+    TCacheList* list = &tc->lists[sc];
+    size_t batch = tcache_release_batch(sc);
+    if (n > batch) n = batch;
+    if (!n || !list->head) return;
+    void* head = list->head;
+    void* tail = head;
+    size_t got = 1;
+    /* sized frees may have pushed objects of other shards */
+    int own = !list->mixed || small_span_of(head)->shard == tc->shard_id;
+    while (got < n && *(void**)tail){
+        tail = *(void**)tail;
+        got++;
+        if (list->mixed && own) own = small_span_of(tail)->shard == tc->shard_id;
+    }
+    list->head = *(void**)tail;
+    *(void**)tail = NULL;
+    if (list->count >= got) list->count -= got; else list->count = 0;
+    if (!list->head) list->mixed = 0;
+    if (got == batch && own && transfer_push(tc->shard_id, sc, head)) return;
+    void* tmp[ got ];
+    for (size_t i = 0; i < got; i++){
+        tmp[i] = head;
+        head = *(void**)head;
+    }
+    central_release_batch(sc, (void**)tmp, got);
+    note_central_release(got);
+}
+
+/* shrink lists until a steal against this cache is paid: a batch per class
+ * (or down to 0 below a batch), round robin so no class is singled out */
+static void tcache_pay(ThreadCache* tc)
+{
+    if (!atomic_load_explicit(&tc->owed, memory_order_relaxed)) return;
+    size_t owed = atomic_exchange_explicit(&tc->owed, 0, memory_order_relaxed);
+    size_t paid = 0;
+    for (int i = 0; i < SIZE_CLASS_COUNT && paid < owed; i++){
+        int sc = (tc->next_shrink + i) % SIZE_CLASS_COUNT;
+        TCacheList* list = &tc->lists[sc];
+        if (!list->max) continue;
+        size_t batch = size_class_info[sc].batch;
+        size_t cut = list->max > batch ? batch : list->max;
+        list->max -= cut;
+        list->overflows = 0;
+        paid += cut * size_class_info[sc].size;
+        while (list->count > list->max && list->head) tcache_flush(tc, sc, list->count - list->max);
+        tc->next_shrink = (sc + 1) % SIZE_CLASS_COUNT;
+    }
+    atomic_fetch_sub_explicit(&tc->capacity, paid, memory_order_relaxed);
+    /* stealers hold owed bytes already; settle the difference with the budget */
+    if (paid > owed) atomic_fetch_sub_explicit(&tcache_budget_used, paid - owed, memory_order_relaxed);
+    else atomic_fetch_add_explicit(&tcache_budget_used, owed - paid, memory_order_relaxed);
+}
+
+/* claim bytes of capacity from the budget while it lasts, then from another
+ * thread, which pays on its next slow path. Threads that missed nothing since
+ * the last round are asked first. 0 when nobody can spare it */
+static int tcache_claim(ThreadCache* tc, size_t bytes)
+{
+    size_t used = atomic_load_explicit(&tcache_budget_used, memory_order_relaxed);
+    while (used + bytes <= DMALLOC_TCACHE_BUDGET){
+        if (atomic_compare_exchange_weak_explicit(&tcache_budget_used, &used, used + bytes,
+                                                  memory_order_relaxed, memory_order_relaxed)){
+            atomic_fetch_add_explicit(&tc->capacity, bytes, memory_order_relaxed);
+            return 1;
+        }
+    }
+    ThreadCache* victim = NULL;
+    pthread_mutex_lock(&tc_pool_lock);
+    for (int pass = 0; pass < 2 && !victim; pass++){
+        ThreadCache* v = tc_steal_next ? tc_steal_next : tc_live;
+        for (size_t i = 0; i < tc_live_count && !victim; i++){
+            size_t misses = atomic_load_explicit(&v->misses, memory_order_relaxed);
+            int idle = misses == v->misses_seen;
+            if (!pass) v->misses_seen = misses;
+            size_t cap = atomic_load_explicit(&v->capacity, memory_order_relaxed);
+            size_t owed = atomic_load_explicit(&v->owed, memory_order_relaxed);
+            if (v != tc && (idle || pass) && cap >= owed + bytes) victim = v;
+            v = v->next_live ? (ThreadCache*)v->next_live : tc_live;
+        }
+        tc_steal_next = v;
+    }
+    if (victim) atomic_fetch_add_explicit(&victim->owed, bytes, memory_order_relaxed);
+    pthread_mutex_unlock(&tc_pool_lock);
+    if (!victim) return 0;
+    atomic_fetch_add_explicit(&tc->capacity, bytes, memory_order_relaxed);
+    return 1;
+}
+
+/* on a miss, or an overflow below one batch: double max up to a batch, then
+ * add a batch at a time */
+static void tcache_grow(ThreadCache* tc, int sc)
+{
+    TCacheList* list = &tc->lists[sc];
+    size_t batch = size_class_info[sc].batch;
+    size_t want;
+    if (list->max < batch){
+        want = list->max ? 2 * list->max : TCACHE_START;
+        if (want > batch) want = batch;
+    } else {
+        want = list->max + batch;
+        if (want > TCACHE_MAX_BATCHES * batch) return;
+    }
+    if (tcache_claim(tc, (want - list->max) * size_class_info[sc].size)){
+        list->max = want;
+        list->overflows = 0;
+    }
+}
+
+/* everything but a thread cache hit: first touch, refill, large and huge */
+void* dmalloc_slow(size_t size)
+{
+    int sc = size_class_for(size);
+    if (sc < 0) return big_alloc(size, NULL);
     ThreadCache* tc = tc_get();
     if (!tc) return NULL;
+#ifdef PERCPU_SUPPORTED
+    if (dmalloc_tls_rseq) return percpu_refill(dmalloc_tls_rseq, sc);
+#endif
     TCacheList* list = &tc->lists[sc];
     if (!list->head){
+        atomic_store_explicit(&tc->misses, atomic_load_explicit(&tc->misses, memory_order_relaxed) + 1,
+                              memory_order_relaxed);
+        tcache_pay(tc);
+        tcache_grow(tc, sc);
         size_t batch = tcache_refill_batch_for_sc(sc);
+        void* chain = list->max >= batch ? transfer_pop(tc->shard_id, sc) : NULL;
+        if (chain){
+            list->head = chain;
+            list->count += batch;
+            void* user = list->head;
+            list->head = *(void**)user;
+            list->count--;
+            return user;
+        }
+        /* below a batch, refill only what the list may keep (at least one) */
+        if (list->max < batch) batch = list->max ? list->max : 1;
         void* tmp[ batch ];
         size_t got = central_fetch_batch(sc, (void**)tmp, batch);
         for (size_t i = 0; i < got; i++){
@@ -265,105 +901,406 @@ void* dmalloc(size_t size)
     return user;
 }
 
+/* small slots are always cleared; large ones only when their span was
+ * handed out dirty, so fresh and madvised pages are never touched */
+void* dcalloc(size_t n, size_t size)
+{
+    size_t total;
+    if (__builtin_mul_overflow(n, size, &total)) return NULL;
+    if (total <= MAX_SMALL){
+        void* p = dmalloc_inline(total);
+        if (p) memset(p, 0, total);
+        return p;
+    }
+    int zeroed = 0;
+    void* p = big_alloc(total, &zeroed);
+    if (p && !zeroed) memset(p, 0, total);
+    return p;
+}
+
 void dfree(void* ptr)
+{
+    dfree_inline(ptr);
+}
+
+void dfree_sized(void* ptr, size_t size)
+{
+    dfree_sized_inline(ptr, size);
+}
+
+#ifdef DMALLOC_DEBUG
+/* small objects must map to their span's class, large ones fit their block */
+void dmalloc_check_size(void* ptr, size_t size)
 {
     if (!ptr) return;
-    ObjHdr* h = (ObjHdr*)((uint8_t*)ptr - obj_header_size());
-    if (h->flags & OBJ_FLAG_LARGE){
-        if (h->flags & OBJ_FLAG_DIRECT){
-            size_t ps = pageheap_page_size();
-            size_t npages = h->size_class;
-            ThreadCache* tc = tc_get();
-            if (tc){
-                for (int i = 0; i < LARGE_BUCKET_COUNT; i++){
-                    LargeBucket* lb = &tc->lbuckets[i];
-                    if (lb->pages == npages && lb->count < lb->target){
-                        h->owner = lb->head;
-                        lb->head = h;
-                        lb->count++;
-                        return;
-                    }
-                }
-            }
-            uint8_t* base = (uint8_t*)h;
-            size_t bytes = npages * ps;
-            munmap(base, bytes);
-            return;
+    SmallSpan* ss = small_span_of(ptr);
+    int sc = size_class_for(size);
+    if (ss ? (int)ss->size_class == sc : sc < 0 && size <= dmalloc_usable_size(ptr)) return;
+    fprintf(stderr, "dmalloc: dfree_sized(%p, %zu) does not match the allocation\n", ptr, size);
+    abort();
+}
+#endif
+
+/* everything but a thread cache push: large/direct, foreign and overflow */
+void dfree_slow(void* ptr)
+{
+    if (!ptr) return;
+    SmallSpan* ss = small_span_of(ptr);
+    if (!ss){
+        ObjHdr* h = large_header_of(ptr);
+        if (!h){
+            span_free(pageheap_span_of(ptr));
+        } else if (h->flags & OBJ_FLAG_DIRECT){
+            munmap(h->owner, h->size_class * page_size);
         } else {
-            Span* sp = (Span*)h->owner;
-            span_free(sp);
-            return;
+            large_free(h);
         }
+        return;
     }
-    int sc = (int)h->size_class;
+    int sc = (int)ss->size_class;
     ThreadCache* tc = tc_get();
     if (!tc){
         void* one = ptr;
         central_release_batch(sc, &one, 1);
         return;
     }
+#ifdef PERCPU_SUPPORTED
+    if (dmalloc_tls_rseq){
+        if (!percpu_push(dmalloc_tls_rseq, sc, ptr)) percpu_overflow(dmalloc_tls_rseq, sc, ptr);
+        return;
+    }
+#endif
+    /* foreign objects go back to their owner instead of drifting into our cache */
+    if (ss->shard != tc->shard_id){
+        remote_free(ss, ptr);
+        return;
+    }
     TCacheList* list = &tc->lists[sc];
     *(void**)ptr = list->head;
     list->head = ptr;
     list->count++;
-    if (list->count > tcache_max()){
-        size_t batch = tcache_release_batch();
-        void* tmp[ batch ];
-        size_t n = 0;
-        while (list->head && n < batch){
-            void* p = list->head;
-            list->head = *(void**)p;
-            tmp[n++] = p;
+    if (list->count > list->max){
+        tcache_pay(tc);
+        size_t batch = tcache_release_batch(sc);
+        if (list->max < batch){
+            /* threads that mostly free need a cache as well */
+            tcache_grow(tc, sc);
+            if (list->count <= list->max) return;
+        } else if (++list->overflows >= TCACHE_SHRINK_OVERFLOWS && list->max > batch){
+            /* keeps overflowing: the extra batch is not earning its keep */
+            size_t bytes = batch * size_class_info[sc].size;
+            list->max -= batch;
+            list->overflows = 0;
+            atomic_fetch_sub_explicit(&tc->capacity, bytes, memory_order_relaxed);
+            atomic_fetch_sub_explicit(&tcache_budget_used, bytes, memory_order_relaxed);
         }
-        if (n){
-            central_release_batch(sc, (void**)tmp, n);
-            if (list->count >= n) list->count -= n; else list->count = 0;
+        while (list->count > list->max && list->head) tcache_flush(tc, sc, batch);
+    }
+}
+
+/* the thread list first, then whole batches from the transfer cache or one
+ * central call per batch-or-more; small remainders and large sizes take the
+ * ordinary path */
+size_t dmalloc_batch(size_t size, void** out, size_t n)
+{
+    size_t got = 0;
+    int sc = size_class_for(size);
+    ThreadCache* tc = sc >= 0 ? tc_get() : NULL;
+#ifdef PERCPU_SUPPORTED
+    /* per-CPU slabs pop one object at a time anyway */
+    if (dmalloc_tls_rseq) tc = NULL;
+#endif
+    if (tc){
+        TCacheList* list = &tc->lists[sc];
+        while (got < n && list->head){
+            out[got++] = list->head;
+            list->head = *(void**)list->head;
+        }
+        list->count -= got;
+        size_t batch = size_class_info[sc].batch;
+        while (n - got >= batch){
+            void* chain = transfer_pop(tc->shard_id, sc);
+            if (chain){
+                while (chain){
+                    out[got++] = chain;
+                    chain = *(void**)chain;
+                }
+                continue;
+            }
+            size_t k = central_fetch_batch(sc, out + got, n - got);
+            if (!k) return got;
+            got += k;
         }
     }
-    unsigned long c = atomic_fetch_add_explicit(&dfree_counter, 1, memory_order_relaxed) + 1;
-    if ((c & 0x7FFFFFFUL) == 0){
-        pageheap_madvise_idle_spans(32);
+    while (got < n){
+        void* p = dmalloc(size);
+        if (!p) break;
+        out[got++] = p;
+    }
+    return got;
+}
+
+/* runs of one class and shard: ours top up the thread list as one chain and
+ * park whole batches in the transfer cache, a foreign run of a batch or more
+ * goes back under one lock round. Leftovers and large objects take the
+ * ordinary path */
+void dfree_batch(void** ptrs, size_t n)
+{
+    ThreadCache* tc = tc_get();
+#ifdef PERCPU_SUPPORTED
+    if (dmalloc_tls_rseq) tc = NULL;
+#endif
+    size_t i = 0;
+    while (i < n){
+        SmallSpan* ss = ptrs[i] ? small_span_of(ptrs[i]) : NULL;
+        if (!ss){
+            dfree(ptrs[i++]);
+            continue;
+        }
+        int sc = (int)ss->size_class;
+        size_t j = i + 1;
+        while (j < n && ptrs[j]){
+            SmallSpan* o = small_span_of(ptrs[j]);
+            if (!o || (int)o->size_class != sc || o->shard != ss->shard) break;
+            j++;
+        }
+        size_t batch = tcache_release_batch(sc);
+        if (tc && ss->shard == tc->shard_id){
+            TCacheList* list = &tc->lists[sc];
+            size_t k = list->max > list->count ? list->max - list->count : 0;
+            if (k > j - i) k = j - i;
+            if (k){
+                for (size_t m = i; m + 1 < i + k; m++) *(void**)ptrs[m] = ptrs[m + 1];
+                *(void**)ptrs[i + k - 1] = list->head;
+                list->head = ptrs[i];
+                list->count += k;
+                i += k;
+            }
+            while (j - i >= batch){
+                for (size_t m = i; m + 1 < i + batch; m++) *(void**)ptrs[m] = ptrs[m + 1];
+                *(void**)ptrs[i + batch - 1] = NULL;
+                if (!transfer_push(tc->shard_id, sc, ptrs[i])){
+                    central_release_batch(sc, ptrs + i, batch);
+                    note_central_release(batch);
+                }
+                i += batch;
+            }
+        } else if (j - i >= batch){
+            central_release_batch(sc, ptrs + i, j - i);
+            note_central_release(j - i);
+            i = j;
+        }
+        for (; i < j; i++) dfree_inline(ptrs[i]);
     }
 }
 
+/* resize a large or direct object without copying: spans grow into the free
+ * span behind them and give back their tail, mappings are moved by mremap.
+ * NULL when the object has to be copied */
+static void* large_resize(void* ptr, size_t size)
+{
+    size_t ps = page_size;
+    ObjHdr* h = large_header_of(ptr);
+    if (h && (h->flags & OBJ_FLAG_DIRECT)){
+#ifdef MREMAP_MAYMOVE
+        uint8_t* base = (uint8_t*)h->owner;
+        size_t off = (size_t)((uint8_t*)ptr - base);
+        if (size > SIZE_MAX - off - ps) return NULL;
+        size_t npages = (off + size + ps - 1) / ps;
+        if (npages == h->size_class) return ptr;
+        void* nb = mremap(base, h->size_class * ps, npages * ps, MREMAP_MAYMOVE);
+        if (nb == MAP_FAILED) return NULL;
+        h = (ObjHdr*)((uint8_t*)nb + off - obj_header_size());
+        h->owner = nb;
+        h->size_class = npages;
+        return (uint8_t*)nb + off;
+#else
+        return NULL;
+#endif
+    }
+    Span* sp = pageheap_span_of(ptr);
+    size_t off = (size_t)((uint8_t*)ptr - (uint8_t*)span_ptr(sp));
+    if (size > SIZE_MAX - off - ps) return NULL;
+    size_t npages = (off + size + ps - 1) / ps;
+    size_t cur = span_page_count(sp);
+    if (npages > cur && span_extend(sp, npages) != 0) return NULL;
+    /* a failed shrink only keeps the tail attached */
+    if (npages < cur) (void)span_shrink(sp, npages);
+    if (h) h->size_class = span_page_count(sp);
+    return ptr;
+}
+
 void* drealloc(void* ptr, size_t size)
 {
     if (!ptr) return dmalloc(size);
-    ObjHdr* h = (ObjHdr*)((uint8_t*)ptr - obj_header_size());
+    SmallSpan* ss = small_span_of(ptr);
     /* if small and same class, return as is */
     int new_sc = size_class_for(size);
-    if (!(h->flags & OBJ_FLAG_LARGE)){
-        int old_sc = (int)h->size_class;
-        if (old_sc == new_sc && old_sc >= 0) return ptr;
+    if (ss){
+        int old_sc = (int)ss->size_class;
+        if (old_sc == new_sc) return ptr;
+    } else if (size > MAX_SMALL){
+        void* p = large_resize(ptr, size);
+        if (p) return p;
     }
     void* n = dmalloc(size);
     if (!n) return NULL;
     /* copy min(old_size, new_size) */
-    size_t old_payload;
-    if (h->flags & OBJ_FLAG_LARGE){
-        size_t ps = pageheap_page_size();
-        size_t total;
-        if (h->flags & OBJ_FLAG_DIRECT){
-            size_t npages = h->size_class;
-            total = npages * ps;
-        } else {
-            Span* sp = (Span*)h->owner;
-            total = span_page_count(sp) * ps;
-        }
-        old_payload = (total > obj_header_size()) ? (total - obj_header_size()) : 0;
-    } else {
-        old_payload = central[0][h->size_class].obj_size;
-    }
+    size_t old_payload = dmalloc_usable_size(ptr);
     size_t copy = old_payload < size ? old_payload : size;
     memcpy(n, ptr, copy);
     dfree(ptr);
     return n;
 }
 
+size_t dmalloc_usable_size(void* ptr)
+{
+    if (!ptr) return 0;
+    SmallSpan* ss = small_span_of(ptr);
+    if (ss) return central[0][ss->size_class].obj_size;
+    ObjHdr* h = large_header_of(ptr);
+    uint8_t* end;
+    if (!h){
+        Span* sp = pageheap_span_of(ptr);
+        end = (uint8_t*)span_ptr(sp) + span_page_count(sp) * page_size;
+    } else if (h->flags & OBJ_FLAG_DIRECT){
+        end = (uint8_t*)h->owner + h->size_class * page_size;
+    } else {
+        Span* sp = (Span*)h->owner;
+        end = (uint8_t*)span_ptr(sp) + span_page_count(sp) * page_size;
+    }
+    return (size_t)(end - (uint8_t*)ptr);
+}
+
+/* alignment above D_ALIGN. Small requests take the first class whose slot
+ * size is a multiple of align: spans start on a page boundary, so its slots are
+ * naturally aligned. Larger ones get a span starting on the boundary and are
+ * returned headerless; huge ones a trimmed mapping with one header page */
+void* dmalloc_aligned(size_t size, size_t align)
+{
+    if (!align || (align & (align - 1))) return NULL;
+    if (align <= D_ALIGN) return dmalloc(size);
+    size_t ps = page_size;
+    if (__builtin_expect(!ps, 0)){
+        dmalloc_init();
+        ps = page_size;
+    }
+    if (align <= ps && size <= MAX_SMALL){
+        int sc = size_class_for(size < align ? align : size);
+        while (sc < SIZE_CLASS_COUNT && size_class_info[sc].size % align) sc++;
+        if (sc < SIZE_CLASS_COUNT) return dmalloc(size_class_info[sc].size);
+    }
+    if (size > SIZE_MAX - align - ps) return NULL;
+    size_t npages = (size + ps - 1) / ps;
+    if (!npages) npages = 1;
+    if (size <= DMALLOC_DIRECT_THRESHOLD){
+        Span* sp = span_alloc_aligned(npages, align > ps ? align / ps : 1);
+        return sp ? span_ptr(sp) : NULL;
+    }
+    return direct_alloc_aligned(npages, align < ps ? ps : align);
+}
+
+void* dmemalign(size_t align, size_t size)
+{
+    return dmalloc_aligned(size, align);
+}
+
+void dmalloc_tcache_stats(size_t* thread_bytes, size_t* total_bytes)
+{
+    ThreadCache* tc = dmalloc_tls_tc;
+    if (thread_bytes) *thread_bytes = tc ? atomic_load_explicit(&tc->capacity, memory_order_relaxed) : 0;
+    if (total_bytes) *total_bytes = atomic_load_explicit(&tcache_budget_used, memory_order_relaxed);
+}
+
+/* wakes every SCAVENGE_INTERVAL_MS and spends the page credit the rate has
+ * earned; a span must stay free for one whole interval to be eligible */
+static void* scavenger_main(void* arg)
+{
+    (void)arg;
+    /* in bytes, so rates of a few pages a second still add up */
+    long long credit = 0;
+    pthread_mutex_lock(&scav_lock);
+    while (atomic_load_explicit(&scav_running, memory_order_relaxed)){
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += SCAVENGE_INTERVAL_MS * 1000000L;
+        if (ts.tv_nsec >= 1000000000L){ ts.tv_sec++; ts.tv_nsec -= 1000000000L; }
+        pthread_cond_timedwait(&scav_cond, &scav_lock, &ts);
+        if (!atomic_load_explicit(&scav_running, memory_order_relaxed)) break;
+        long long per_sec = (long long)scav_rate;
+        pthread_mutex_unlock(&scav_lock);
+        /* credit left unspent while the heap is busy caps at one second's worth */
+        credit += per_sec / (1000 / SCAVENGE_INTERVAL_MS);
+        if (credit > per_sec) credit = per_sec;
+        transfer_drain(1);
+        /* whole spans are advised, so a step may overdraw the credit */
+        size_t pages = credit > 0 ? (size_t)credit / page_size : 0;
+        if (pages) credit -= (long long)(pageheap_scavenge(pages) * page_size);
+        pthread_mutex_lock(&scav_lock);
+    }
+    pthread_mutex_unlock(&scav_lock);
+    return NULL;
+}
+
+size_t dmalloc_transfer_bytes(void)
+{
+    size_t bytes = 0;
+    for (int shard = 0; shard < CENTRAL_SHARDS; shard++)
+        for (int sc = 0; sc < SIZE_CLASS_COUNT; sc++)
+            for (int i = 0; i < TRANSFER_SLOTS; i++)
+                if (atomic_load_explicit(&transfer[shard][sc].slots[i], memory_order_relaxed))
+                    bytes += (size_t)size_class_info[sc].batch * size_class_info[sc].size;
+    return bytes;
+}
+
+size_t dmalloc_trim(void)
+{
+    dmalloc_init();
+    transfer_drain(0);
+    return pageheap_release_empty_spans(1);
+}
+
+int dmalloc_scavenger_start(size_t bytes_per_sec)
+{
+    dmalloc_init();
+    if (bytes_per_sec < page_size) bytes_per_sec = page_size;
+    /* keeps the byte credit far from overflow */
+    if (bytes_per_sec > ((size_t)1 << 50)) bytes_per_sec = (size_t)1 << 50;
+    pthread_mutex_lock(&scav_lock);
+    scav_rate = bytes_per_sec;
+    if (atomic_load_explicit(&scav_running, memory_order_relaxed)){
+        pthread_mutex_unlock(&scav_lock);
+        return 0;
+    }
+    atomic_store_explicit(&scav_running, 1, memory_order_relaxed);
+    if (pthread_create(&scav_thread, NULL, scavenger_main, NULL) != 0){
+        atomic_store_explicit(&scav_running, 0, memory_order_relaxed);
+        pthread_mutex_unlock(&scav_lock);
+        return -1;
+    }
+    pthread_mutex_unlock(&scav_lock);
+    return 0;
+}
+
+void dmalloc_scavenger_stop(void)
+{
+    pthread_mutex_lock(&scav_lock);
+    if (!atomic_load_explicit(&scav_running, memory_order_relaxed)){
+        pthread_mutex_unlock(&scav_lock);
+        return;
+    }
+    atomic_store_explicit(&scav_running, 0, memory_order_relaxed);
+    pthread_t t = scav_thread;
+    pthread_cond_signal(&scav_cond);
+    pthread_mutex_unlock(&scav_lock);
+    pthread_join(t, NULL);
+}
+
 void dmalloc_init(void)
 {
     central_init_once();
     if (!pageheap_page_size()) pageheap_init();
+    page_size = pageheap_page_size();
 }
 
 __attribute__((constructor)) static void dmalloc_constructor(void)
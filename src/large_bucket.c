@@ -2,108 +2,97 @@
 #include "../include/large_bucket.h"
 #include <string.h>
 #include <stdint.h>
-#include <stdlib.h>
-#include <time.h>
-#include <pthread.h>
-#include <sys/mman.h>
 
-static inline int skip_less(const Span* a, const Span* b){
-    if (a->page_count != b->page_count) return a->page_count < b->page_count;
-    return (uintptr_t)a->start < (uintptr_t)b->start;
-}
-
-static __thread uint64_t rng_state;
-static inline uint64_t mix64(uint64_t x){
-    x ^= x >> 33;
-    x *= 0xff51afd7ed558ccdULL;
-    x ^= x >> 33;
-    x *= 0xc4ceb9fe1a85ec53ULL;
-    x ^= x >> 33;
-    return x;
-}
-static inline uint32_t tls_rand(void){
-    if (rng_state == 0){
-        uintptr_t t = (uintptr_t)pthread_self();
-        rng_state = mix64(t ^ (uintptr_t)&rng_state);
-        if (rng_state == 0) rng_state = 0x9e3779b97f4a7c15ULL;
-    }
-    rng_state ^= rng_state << 13;
-    rng_state ^= rng_state >> 7;
-    rng_state ^= rng_state << 17;
-    return (uint32_t)rng_state;
-}
-static int random_level(void){
-    int lvl = 1;
-    while ((tls_rand() & 1u) && lvl < MAX_SKIP_LEVELS) lvl++;
-    return lvl;
+/* class of a span of page_count >= MAX_BUCKETS pages */
+static inline void large_mapping(size_t page_count, unsigned* fl, unsigned* sl)
+{
+    unsigned f = 63u - (unsigned)__builtin_clzll((unsigned long long)page_count);
+    *sl = (unsigned)(page_count >> (f - LARGE_SL_BITS)) & (LARGE_SL_COUNT - 1);
+    *fl = f - LARGE_FL_SHIFT;
 }
 
-/* internal: ensure sentinel head exists */
-static void ensure_head(PageHeap* heap)
+/* head of the first non-empty class at or after (fl, sl); NULL if none */
+static Span* large_search(PageHeap* heap, unsigned fl, unsigned sl)
 {
-    if (heap->large_skip_head) return;
-    /* allocate a Span node via mmap as skiplist head (not freed) */
-    size_t sz = sizeof(Span);
-    void* mem = mmap(NULL, sz, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-    if (mem == MAP_FAILED) return;
-    Span* head = (Span*)mem;
-    if (!head) return;
-    memset(head, 0, sizeof(Span));
-    head->skip_level = MAX_SKIP_LEVELS;
-    for (int i = 0; i < MAX_SKIP_LEVELS; i++) head->skip_next[i] = NULL;
-    heap->large_skip_head = head;
+    if (fl >= LARGE_FL_COUNT) return NULL;
+    uint32_t slm = heap->large_sl_mask[fl] & (~0u << sl);
+    if (!slm){
+        uint64_t flm = fl + 1 < 64 ? heap->large_fl_mask & (~(uint64_t)0 << (fl + 1)) : 0;
+        if (!flm) return NULL;
+        fl = (unsigned)__builtin_ctzll(flm);
+        slm = heap->large_sl_mask[fl];
+    }
+    return heap->large_lists[fl][__builtin_ctz(slm)];
 }
 
 void large_bucket_init(PageHeap* heap)
 {
-    heap->large_skip_head = NULL;
-    ensure_head(heap);
+    memset(heap->large_lists, 0, sizeof(heap->large_lists));
+    memset(heap->large_sl_mask, 0, sizeof(heap->large_sl_mask));
+    heap->large_fl_mask = 0;
 }
 
 void large_bucket_insert(PageHeap* heap, Span* s)
 {
-    ensure_head(heap);
-    Span* update[MAX_SKIP_LEVELS];
-    Span* x = heap->large_skip_head;
-    for (int i = MAX_SKIP_LEVELS - 1; i >= 0; i--){
-        while (x->skip_next[i] && skip_less(x->skip_next[i], s)) x = x->skip_next[i];
-        update[i] = x;
-    }
-    int lvl = random_level();
-    s->skip_level = (unsigned char)lvl;
-    for (int i = 0; i < lvl; i++){
-        s->skip_next[i] = update[i]->skip_next[i];
-        update[i]->skip_next[i] = s;
-    }
+    unsigned fl, sl;
+    large_mapping(s->page_count, &fl, &sl);
+    Span* head = heap->large_lists[fl][sl];
+    s->prev_free_addr = NULL;
+    s->next_free_addr = head;
+    if (head) head->prev_free_addr = s;
+    heap->large_lists[fl][sl] = s;
+    heap->large_sl_mask[fl] |= 1u << sl;
+    heap->large_fl_mask |= (uint64_t)1 << fl;
 }
 
 void large_bucket_remove(PageHeap* heap, Span* s)
 {
-    if (!heap->large_skip_head || !s) return;
-    Span* update[MAX_SKIP_LEVELS];
-    Span* x = heap->large_skip_head;
-    for (int i = MAX_SKIP_LEVELS - 1; i >= 0; i--){
-        while (x->skip_next[i] && skip_less(x->skip_next[i], s)) x = x->skip_next[i];
-        update[i] = x;
+    if (!s) return;
+    unsigned fl, sl;
+    large_mapping(s->page_count, &fl, &sl);
+    if (s->prev_free_addr) s->prev_free_addr->next_free_addr = s->next_free_addr;
+    else heap->large_lists[fl][sl] = s->next_free_addr;
+    if (s->next_free_addr) s->next_free_addr->prev_free_addr = s->prev_free_addr;
+    s->next_free_addr = NULL;
+    s->prev_free_addr = NULL;
+    if (!heap->large_lists[fl][sl]){
+        heap->large_sl_mask[fl] &= ~(1u << sl);
+        if (!heap->large_sl_mask[fl]) heap->large_fl_mask &= ~((uint64_t)1 << fl);
     }
-    Span* target = x->skip_next[0];
-    if (target != s){
-        /* not found; do nothing */
-        return;
-    }
-    for (int i = 0; i < MAX_SKIP_LEVELS; i++){
-        if (update[i]->skip_next[i] == s) update[i]->skip_next[i] = s->skip_next[i];
-    }
-    for (int i = 0; i < MAX_SKIP_LEVELS; i++) s->skip_next[i] = NULL;
-    s->skip_level = 0;
 }
 
 Span* large_bucket_lower_bound(PageHeap* heap, size_t need)
 {
-    if (!heap->large_skip_head) return NULL;
-    Span* x = heap->large_skip_head;
-    for (int i = MAX_SKIP_LEVELS - 1; i >= 0; i--){
-        while (x->skip_next[i] && x->skip_next[i]->page_count < need) x = x->skip_next[i];
+    if (need < MAX_BUCKETS) need = MAX_BUCKETS;
+    unsigned fl, sl;
+    /* round up to the next class boundary so any span found is big enough */
+    unsigned f = 63u - (unsigned)__builtin_clzll((unsigned long long)need);
+    size_t round = need + (((size_t)1 << (f - LARGE_SL_BITS)) - 1);
+    if (round >= need){
+        large_mapping(round, &fl, &sl);
+        Span* s = large_search(heap, fl, sl);
+        if (s) return s;
     }
-    return x->skip_next[0];
+    /* no larger class is populated; the head of need's own class may still fit */
+    large_mapping(need, &fl, &sl);
+    Span* h = heap->large_lists[fl][sl];
+    return (h && h->page_count >= need) ? h : NULL;
+}
+
+Span* large_bucket_first(PageHeap* heap, size_t min_pages)
+{
+    if (min_pages < MAX_BUCKETS) min_pages = MAX_BUCKETS;
+    unsigned fl, sl;
+    large_mapping(min_pages, &fl, &sl);
+    return large_search(heap, fl, sl);
+}
+
+Span* large_bucket_next(PageHeap* heap, Span* s)
+{
+    if (!s) return NULL;
+    if (s->next_free_addr) return s->next_free_addr;
+    unsigned fl, sl;
+    large_mapping(s->page_count, &fl, &sl);
+    if (sl + 1 < LARGE_SL_COUNT) return large_search(heap, fl, sl + 1);
+    return large_search(heap, fl + 1, 0);
 }
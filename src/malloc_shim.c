@@ -0,0 +1,86 @@
+#include "../include/dmalloc.h"
+#include <errno.h>
+#include <unistd.h>
+
+/* libc allocation entry points forwarding to dmalloc; linked only into
+ * libdmalloc.so so it can replace malloc through LD_PRELOAD */
+
+#define SHIM_EXPORT __attribute__((visibility("default")))
+
+SHIM_EXPORT void* malloc(size_t size)
+{
+    void* p = dmalloc(size);
+    if (!p) errno = ENOMEM;
+    return p;
+}
+
+SHIM_EXPORT void free(void* ptr)
+{
+    dfree(ptr);
+}
+
+SHIM_EXPORT void* calloc(size_t n, size_t size)
+{
+    void* p = dcalloc(n, size);
+    if (!p) errno = ENOMEM;
+    return p;
+}
+
+SHIM_EXPORT void* realloc(void* ptr, size_t size)
+{
+    if (ptr && size == 0){
+        dfree(ptr);
+        return NULL;
+    }
+    void* p = drealloc(ptr, size);
+    if (!p) errno = ENOMEM;
+    return p;
+}
+
+SHIM_EXPORT void* memalign(size_t align, size_t size)
+{
+    void* p = dmemalign(align, size);
+    if (!p) errno = (align & (align - 1)) ? EINVAL : ENOMEM;
+    return p;
+}
+
+SHIM_EXPORT int posix_memalign(void** out, size_t align, size_t size)
+{
+    if (align < sizeof(void*) || (align & (align - 1))) return EINVAL;
+    void* p = dmemalign(align, size);
+    if (!p) return ENOMEM;
+    *out = p;
+    return 0;
+}
+
+SHIM_EXPORT void* aligned_alloc(size_t align, size_t size)
+{
+    return memalign(align, size);
+}
+
+SHIM_EXPORT void* valloc(size_t size)
+{
+    return memalign((size_t)getpagesize(), size);
+}
+
+SHIM_EXPORT void* pvalloc(size_t size)
+{
+    size_t ps = (size_t)getpagesize();
+    if (size > SIZE_MAX - ps){
+        errno = ENOMEM;
+        return NULL;
+    }
+    return memalign(ps, (size + ps - 1) & ~(ps - 1));
+}
+
+/* pad is ignored: every free span goes back */
+SHIM_EXPORT int malloc_trim(size_t pad)
+{
+    (void)pad;
+    return dmalloc_trim() > 0;
+}
+
+SHIM_EXPORT size_t malloc_usable_size(void* ptr)
+{
+    return dmalloc_usable_size(ptr);
+}
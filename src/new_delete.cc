@@ -0,0 +1,63 @@
+#include <cstddef>
+#include <new>
+
+/* dmalloc.h is C11-only; the operators need just these */
+extern "C" {
+void* dmalloc(std::size_t size);
+void  dfree(void* ptr);
+void  dfree_sized(void* ptr, std::size_t size);
+void* dmemalign(std::size_t align, std::size_t size);
+}
+
+/* C++ allocation operators on top of dmalloc; linked into libdmalloc.so
+ * next to malloc_shim.c */
+
+static void* new_impl(std::size_t size, std::size_t align)
+{
+    for (;;){
+        void* p = align ? dmemalign(align, size) : dmalloc(size);
+        if (p) return p;
+        std::new_handler h = std::get_new_handler();
+        if (!h) throw std::bad_alloc();
+        h();
+    }
+}
+
+static void* new_nothrow(std::size_t size, std::size_t align) noexcept
+{
+    try {
+        return new_impl(size, align);
+    } catch (...) {
+        return nullptr;
+    }
+}
+
+void* operator new(std::size_t size) { return new_impl(size, 0); }
+void* operator new[](std::size_t size) { return new_impl(size, 0); }
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept { return new_nothrow(size, 0); }
+void* operator new[](std::size_t size, const std::nothrow_t&) noexcept { return new_nothrow(size, 0); }
+
+void operator delete(void* p) noexcept { dfree(p); }
+void operator delete[](void* p) noexcept { dfree(p); }
+void operator delete(void* p, const std::nothrow_t&) noexcept { dfree(p); }
+void operator delete[](void* p, const std::nothrow_t&) noexcept { dfree(p); }
+void operator delete(void* p, std::size_t size) noexcept { dfree_sized(p, size); }
+void operator delete[](void* p, std::size_t size) noexcept { dfree_sized(p, size); }
+
+void* operator new(std::size_t size, std::align_val_t al) { return new_impl(size, (std::size_t)al); }
+void* operator new[](std::size_t size, std::align_val_t al) { return new_impl(size, (std::size_t)al); }
+void* operator new(std::size_t size, std::align_val_t al, const std::nothrow_t&) noexcept
+{
+    return new_nothrow(size, (std::size_t)al);
+}
+void* operator new[](std::size_t size, std::align_val_t al, const std::nothrow_t&) noexcept
+{
+    return new_nothrow(size, (std::size_t)al);
+}
+
+void operator delete(void* p, std::align_val_t) noexcept { dfree(p); }
+void operator delete[](void* p, std::align_val_t) noexcept { dfree(p); }
+void operator delete(void* p, std::size_t, std::align_val_t) noexcept { dfree(p); }
+void operator delete[](void* p, std::size_t, std::align_val_t) noexcept { dfree(p); }
+void operator delete(void* p, std::align_val_t, const std::nothrow_t&) noexcept { dfree(p); }
+void operator delete[](void* p, std::align_val_t, const std::nothrow_t&) noexcept { dfree(p); }
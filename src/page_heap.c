@@ -1,6 +1,5 @@
 #include "../include/page_heap.h"
 #include "../include/large_bucket.h"
-#include <stdlib.h>
 #include <unistd.h>
 #include <sys/mman.h>
 #include <string.h>
@@ -8,7 +7,18 @@
 #include <pthread.h>
 
 static PageHeap page_heap;
-static pthread_mutex_t page_heap_mutex;
+static pthread_mutex_t page_heap_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* reserved arena [arena_base, arena_end); pages below arena_top have been
+ * handed to the heap at least once. Kept across pageheap_init() */
+static uint8_t* arena_base;
+static uint8_t* arena_end;
+static uint8_t* arena_top;
+
+/* pagemap root and log2(page size); kept across pageheap_init() */
+Span*** pageheap_pagemap_root;
+size_t pageheap_pagemap_len;
+size_t pageheap_pagemap_shift;
 
 
 /*get current page size in bytes*/
@@ -17,6 +27,48 @@ static inline size_t psize(void)
     return page_heap.page_size;
 }
 
+static inline int in_arena(const void* p)
+{
+    return (const uint8_t*)p >= arena_base && (const uint8_t*)p < arena_end;
+}
+
+#ifdef DMALLOC_HUGEPAGE
+/* in-use pages per arena hugepage */
+static uint16_t* hp_used;
+
+/*add sign * (pages of s in each hugepage) to the per-hugepage use counts*/
+static void hp_account(Span* s, int sign)
+{
+    if (!hp_used || !in_arena(s->start)) return;
+    uintptr_t a = (uintptr_t)s->start - (uintptr_t)arena_base;
+    uintptr_t b = a + s->page_count * psize();
+    while (a < b){
+        uintptr_t hp_end = (a & ~(HUGEPAGE_SIZE - 1)) + HUGEPAGE_SIZE;
+        uintptr_t end = hp_end < b ? hp_end : b;
+        hp_used[a / HUGEPAGE_SIZE] += (uint16_t)(sign * (int)((end - a) / psize()));
+        a = end;
+    }
+}
+
+/*no page of the hugepage holding s's first page is in use*/
+static inline int hp_idle(Span* s)
+{
+    if (!hp_used || !in_arena(s->start)) return 0;
+    return hp_used[((uintptr_t)s->start - (uintptr_t)arena_base) / HUGEPAGE_SIZE] == 0;
+}
+
+/*the whole hugepages inside [start, start + page_count pages); 0 if none*/
+static inline size_t hp_inner(void* start, size_t page_count, uintptr_t* out)
+{
+    uintptr_t a = (uintptr_t)start, b = a + page_count * psize();
+    uintptr_t lo = (a + HUGEPAGE_SIZE - 1) & ~(HUGEPAGE_SIZE - 1);
+    uintptr_t hi = b & ~(HUGEPAGE_SIZE - 1);
+    if (lo >= hi) return 0;
+    *out = lo;
+    return (hi - lo) / psize();
+}
+#endif
+
 /* a bucket is a list of free spans which was divided by page_count.
  * spans with same page_count are put in the same bucket.
 */
@@ -38,6 +90,7 @@ static void* meta_chunk_new(size_t n)
     size_t sz = n * sizeof(Span);
     void* p = mmap(NULL, sz, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
     if (p == MAP_FAILED) return NULL;
+    page_heap.span_records += n;
     char* it = (char*)p;
     for (size_t i = 0; i < n; i++){
         Span* s = (Span*)(it + i * sizeof(Span));
@@ -73,13 +126,29 @@ static void bucket_insert(Span* s)
     size_t idx = bucket_index(s->page_count);
     if (is_large_bucket_idx(idx)){
         large_bucket_insert(&page_heap, s);
-    }else{
-        s->next_free_addr = page_heap.free_buckets[idx];
-        page_heap.free_buckets[idx] = s;
+        return;
     }
+#ifdef DMALLOC_HUGEPAGE
+    /* filler order: spans whose hugepage is idle go last so it can stay whole */
+    Span* tail = page_heap.free_tails[idx];
+    if (tail && hp_idle(s)){
+        s->next_free_addr = NULL;
+        s->prev_free_addr = tail;
+        tail->next_free_addr = s;
+        page_heap.free_tails[idx] = s;
+        return;
+    }
+    if (!tail) page_heap.free_tails[idx] = s;
+#endif
+    Span* head = page_heap.free_buckets[idx];
+    s->prev_free_addr = NULL;
+    s->next_free_addr = head;
+    if (head) head->prev_free_addr = s;
+    page_heap.free_buckets[idx] = s;
+    page_heap.free_mask |= (uint64_t)1 << idx;
 }
 
-/*remove a specific span from its size bucket list*/
+/*unlink a specific span from its size bucket list*/
 static void bucket_remove(Span* s)
 {
     size_t idx = bucket_index(s->page_count);
@@ -87,97 +156,275 @@ static void bucket_remove(Span* s)
         large_bucket_remove(&page_heap, s);
         return;
     }
-    Span* cur = page_heap.free_buckets[idx];
-    Span* prev = NULL;
-    while (cur){
-        if (cur == s){
-            if (prev) prev->next_free_addr = cur->next_free_addr;
-            else page_heap.free_buckets[idx] = cur->next_free_addr;
-            s->next_free_addr = NULL;
-            return;
-        }
-        prev = cur;
-        cur = cur->next_free_addr;
-    }
+    if (s->prev_free_addr) s->prev_free_addr->next_free_addr = s->next_free_addr;
+    else page_heap.free_buckets[idx] = s->next_free_addr;
+    if (s->next_free_addr) s->next_free_addr->prev_free_addr = s->prev_free_addr;
+#ifdef DMALLOC_HUGEPAGE
+    else page_heap.free_tails[idx] = s->prev_free_addr;
+#endif
+    if (!page_heap.free_buckets[idx]) page_heap.free_mask &= ~((uint64_t)1 << idx);
+    s->next_free_addr = NULL;
+    s->prev_free_addr = NULL;
 }
 
-/*insert span into address-sorted doubly-linked list*/
-static void addr_insert_sorted(Span* s)
+/*head of the first non-empty small bucket at or after idx; NULL if none*/
+static inline Span* small_bucket_from(size_t idx)
 {
-    if (!page_heap.addr_head){
-        page_heap.addr_head = s;
-        s->prev_addr = NULL;
-        s->next_addr = NULL;
-        return;
+    uint64_t m = idx < 64 ? page_heap.free_mask & (~(uint64_t)0 << idx) : 0;
+    return m ? page_heap.free_buckets[__builtin_ctzll(m)] : NULL;
+}
+
+/*first free span in a bucket that may hold min_pages pages; the large bucket
+ *shares classes between sizes, so callers still check page_count*/
+static Span* free_iter_first(size_t min_pages)
+{
+    Span* s = small_bucket_from(bucket_index(min_pages));
+    return s ? s : large_bucket_first(&page_heap, min_pages);
+}
+
+/*free span following s in bucket order*/
+static Span* free_iter_next(Span* s)
+{
+    size_t idx = bucket_index(s->page_count);
+    if (is_large_bucket_idx(idx)) return large_bucket_next(&page_heap, s);
+    if (s->next_free_addr) return s->next_free_addr;
+    Span* n = small_bucket_from(idx + 1);
+    return n ? n : large_bucket_first(&page_heap, MAX_BUCKETS);
+}
+
+/*reserve the pagemap root array; leaves are mapped on demand*/
+static void pagemap_init(void)
+{
+    if (pageheap_pagemap_root) return;
+    pageheap_pagemap_shift = (size_t)__builtin_ctzl(psize());
+    size_t len = (size_t)1 << (PAGEMAP_ADDR_BITS - pageheap_pagemap_shift - PAGEMAP_LEAF_BITS);
+    void* p = mmap(NULL, len * sizeof(Span**), PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (p == MAP_FAILED) return;
+    pageheap_pagemap_root = (Span***)p;
+    pageheap_pagemap_len = len;
+}
+
+/*make sure leaves covering [start, start + page_count pages) exist*/
+static int pagemap_ensure(void* start, size_t page_count)
+{
+    if (!pageheap_pagemap_root) return -1;
+    uintptr_t first = (uintptr_t)start >> pageheap_pagemap_shift;
+    uintptr_t last = first + page_count - 1;
+    for (uintptr_t i = first >> PAGEMAP_LEAF_BITS; i <= (last >> PAGEMAP_LEAF_BITS); i++){
+        if (i >= pageheap_pagemap_len) return -1;
+        if (pageheap_pagemap_root[i]) continue;
+        size_t sz = ((size_t)1 << PAGEMAP_LEAF_BITS) * sizeof(Span*);
+        void* leaf = mmap(NULL, sz, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (leaf == MAP_FAILED) return -1;
+        pageheap_pagemap_root[i] = (Span**)leaf;
     }
-    Span* cur = page_heap.addr_head;
-    Span* prev = NULL;
-    uintptr_t addr = (uintptr_t)s->start;
-    while (cur && (uintptr_t)cur->start < addr){
-        prev = cur;
-        cur = cur->next_addr;
+    return 0;
+}
+
+/*point every page of [start, start + page_count pages) at s; leaves must exist*/
+static void pagemap_set(void* start, size_t page_count, Span* s)
+{
+    uintptr_t page = (uintptr_t)start >> pageheap_pagemap_shift;
+    const uintptr_t mask = ((uintptr_t)1 << PAGEMAP_LEAF_BITS) - 1;
+    for (size_t i = 0; i < page_count; i++, page++){
+        pageheap_pagemap_root[page >> PAGEMAP_LEAF_BITS][page & mask] = s;
     }
-    s->prev_addr = prev;
-    s->next_addr = cur;
-    if (prev) prev->next_addr = s; else page_heap.addr_head = s;
-    if (cur) cur->prev_addr = s;
 }
 
-/*remove span from address-sorted doubly-linked list*/
-static void addr_remove(Span* s)
+/*Span recorded for page number page; NULL when the page is not heap memory*/
+static inline Span* pagemap_get(uintptr_t page)
 {
-    if (s->prev_addr) s->prev_addr->next_addr = s->next_addr;
-    else page_heap.addr_head = s->next_addr;
-    if (s->next_addr) s->next_addr->prev_addr = s->prev_addr;
-    s->prev_addr = NULL;
-    s->next_addr = NULL;
+    uintptr_t i = page >> PAGEMAP_LEAF_BITS;
+    if (i >= pageheap_pagemap_len || !pageheap_pagemap_root[i]) return NULL;
+    return pageheap_pagemap_root[i][page & (((uintptr_t)1 << PAGEMAP_LEAF_BITS) - 1)];
 }
 
-/*check if two free spans are adjacent and can merge*/
-static int can_coalesce(Span* a, Span* b)
+/*boundary tags: a free span is recorded at its first and last page, which is
+ *all coalescing needs; its interior entries may be stale*/
+static void pagemap_tag(Span* s)
 {
-    if (!a || !b) return 0;
-    if (a->in_use || b->in_use) return 0;
-    uintptr_t a_end = (uintptr_t)a->start + a->page_count * psize();
-    return a_end == (uintptr_t)b->start;
+    pagemap_set(s->start, 1, s);
+    if (s->page_count > 1) pagemap_set((uint8_t*)s->start + (s->page_count - 1) * psize(), 1, s);
+}
+
+/*a merged span counts as released (or zeroed) only if both parts were*/
+static void merge_released(Span* into, Span* from)
+{
+    into->zeroed &= from->zeroed;
+    if (into->released == from->released) return;
+    page_heap.released_pages -= into->released ? into->page_count : from->page_count;
+    into->released = 0;
 }
 
 /*merge with left/right free neighbors and reinsert into bucket*/
 static void coalesce_neighbors(Span* s)
 {
-    Span* left = s->prev_addr;
-    if (can_coalesce(left, s)){
+    uintptr_t first = (uintptr_t)s->start >> pageheap_pagemap_shift;
+    Span* left = pagemap_get(first - 1);
+    if (left && !left->in_use){
         bucket_remove(left);
+        merge_released(left, s);
         left->page_count += s->page_count;
-        left->next_addr = s->next_addr;
-        if (s->next_addr) s->next_addr->prev_addr = left;
         meta_release(s);
         s = left;
+        first = (uintptr_t)s->start >> pageheap_pagemap_shift;
         page_heap.spans_free -= 1;
     }
-    Span* right = s->next_addr;
-    if (can_coalesce(s, right)){
+    Span* right = pagemap_get(first + s->page_count);
+    if (right && !right->in_use){
         bucket_remove(right);
+        merge_released(s, right);
         s->page_count += right->page_count;
-        s->next_addr = right->next_addr;
-        if (right->next_addr) right->next_addr->prev_addr = s;
         meta_release(right);
         page_heap.spans_free -= 1;
     }
+    s->free_epoch = page_heap.epoch;
+    pagemap_tag(s);
     bucket_insert(s);
 }
 
+/*reserve the arena address range; commits nothing*/
+static void arena_init(void)
+{
+    if (arena_base) return;
+    /* settle for less when the address space is limited */
+    for (size_t bytes = PAGEHEAP_ARENA_BYTES; bytes >= ((size_t)1 << 30); bytes >>= 1){
+#ifdef DMALLOC_HUGEPAGE
+        /* over-reserve so the arena can start on a hugepage boundary */
+        void* p = mmap(NULL, bytes + HUGEPAGE_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (p == MAP_FAILED) continue;
+        uint8_t* base = (uint8_t*)(((uintptr_t)p + HUGEPAGE_SIZE - 1) & ~(HUGEPAGE_SIZE - 1));
+        (void)madvise(base, bytes, MADV_HUGEPAGE);
+        void* used = mmap(NULL, bytes / HUGEPAGE_SIZE * sizeof(uint16_t), PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        hp_used = used == MAP_FAILED ? NULL : (uint16_t*)used;
+        arena_base = arena_top = base;
+#else
+        void* p = mmap(NULL, bytes, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (p == MAP_FAILED) continue;
+        arena_base = arena_top = (uint8_t*)p;
+#endif
+        arena_end = arena_base + bytes;
+        return;
+    }
+}
+
+static void returned_insert(Span* s)
+{
+    s->prev_free_addr = NULL;
+    s->next_free_addr = page_heap.returned;
+    if (page_heap.returned) page_heap.returned->prev_free_addr = s;
+    page_heap.returned = s;
+}
+
+static void returned_remove(Span* s)
+{
+    if (s->prev_free_addr) s->prev_free_addr->next_free_addr = s->next_free_addr;
+    else page_heap.returned = s->next_free_addr;
+    if (s->next_free_addr) s->next_free_addr->prev_free_addr = s->prev_free_addr;
+    s->next_free_addr = NULL;
+    s->prev_free_addr = NULL;
+}
+
+/*commit page_count pages of the arena, reusing returned ranges first; NULL when
+ *the reservation cannot satisfy the request*/
+static void* arena_take(size_t page_count)
+{
+    size_t bytes = page_count * psize();
+    void* p = NULL;
+    for (Span* r = page_heap.returned; r; r = r->next_free_addr){
+        if (r->page_count < page_count) continue;
+        p = r->start;
+        returned_remove(r);
+        if (r->page_count == page_count){
+            meta_release(r);
+        }else{
+            r->start = (uint8_t*)r->start + bytes;
+            r->page_count -= page_count;
+            pagemap_tag(r);
+            returned_insert(r);
+        }
+        break;
+    }
+    if (!p){
+        if (!arena_base || (size_t)(arena_end - arena_top) < bytes) return NULL;
+        if (pagemap_ensure(arena_top, page_count) != 0) return NULL;
+        p = arena_top;
+        arena_top += bytes;
+    }
+    if (mprotect(p, bytes, PROT_READ | PROT_WRITE) != 0){
+        /* leave the range reserved; it is simply lost to the heap */
+        return NULL;
+    }
+    return p;
+}
+
+/*drop the pages and commit charge of an arena range; keeps the reservation*/
+static void arena_decommit(void* p, size_t bytes)
+{
+    (void)mmap(p, bytes, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+}
+
+/*file a decommitted range for reuse, merging with returned neighbors; its
+ *pagemap entries are NULL and only the merged boundaries get tagged*/
+static void arena_return(Span* s)
+{
+    s->in_use = SPAN_RETURNED;
+    uintptr_t first = (uintptr_t)s->start >> pageheap_pagemap_shift;
+    Span* left = pagemap_get(first - 1);
+    if (left && left->in_use == SPAN_RETURNED){
+        returned_remove(left);
+        pagemap_set((uint8_t*)left->start + (left->page_count - 1) * psize(), 1, NULL);
+        left->page_count += s->page_count;
+        meta_release(s);
+        s = left;
+        first = (uintptr_t)s->start >> pageheap_pagemap_shift;
+    }
+    Span* right = pagemap_get(first + s->page_count);
+    if (right && right->in_use == SPAN_RETURNED){
+        returned_remove(right);
+        pagemap_set(right->start, 1, NULL);
+        s->page_count += right->page_count;
+        meta_release(right);
+    }
+    uint8_t* end = (uint8_t*)s->start + s->page_count * psize();
+    if (end == arena_top){
+        /* the range sits at the frontier: pull the frontier back instead */
+        pagemap_set(s->start, 1, NULL);
+        pagemap_set(end - psize(), 1, NULL);
+        arena_top = (uint8_t*)s->start;
+        meta_release(s);
+        return;
+    }
+    pagemap_tag(s);
+    returned_insert(s);
+}
+
 /*initialize page heap state and metadata pool*/
 void pageheap_init(void)
 {
     memset(&page_heap, 0, sizeof(page_heap));
     page_heap.page_size = (size_t)sysconf(_SC_PAGESIZE);
     meta_free_list = NULL;
-    /* initialize large bucket skiplist */
+    /* initialize large bucket lists */
     large_bucket_init(&page_heap);
+    pagemap_init();
+    arena_init();
     pthread_mutex_init(&page_heap_mutex, NULL);
 }
 
+void pageheap_fork_prepare(void)
+{
+    pthread_mutex_lock(&page_heap_mutex);
+}
+
+void pageheap_fork_release(void)
+{
+    pthread_mutex_unlock(&page_heap_mutex);
+}
+
 /*return page size for external queries*/
 size_t pageheap_page_size(void)
 {
@@ -199,16 +446,28 @@ static int pageheap_grow_nolock(size_t page_count)
 {
     if (!page_heap.page_size) pageheap_init();
     if (!page_count) page_count = DEFAULT_GROW_PAGES;
+#ifdef DMALLOC_HUGEPAGE
+    /* commit whole hugepages; the surplus is simply more free pages */
+    size_t hp_pages = HUGEPAGE_SIZE / psize();
+    page_count = (page_count + hp_pages - 1) / hp_pages * hp_pages;
+#endif
     size_t bytes = page_count * psize();
-    void* p = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-    if (p == MAP_FAILED) return -1;
-    Span* s = span_create(p, 0);
-    if (!s){
-        munmap(p, bytes);
-        return -1;
+    Span* s = span_create(NULL, 0);
+    if (!s) return -1;
+    void* p = arena_take(page_count);
+    if (!p){
+        p = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED || pagemap_ensure(p, page_count) != 0){
+            if (p != MAP_FAILED) munmap(p, bytes);
+            meta_release(s);
+            return -1;
+        }
     }
+    s->start = p;
+    s->zeroed = 1;
+    s->free_epoch = page_heap.epoch;
     s->page_count = page_count;
-    addr_insert_sorted(s);
+    pagemap_tag(s);
     bucket_insert(s);
     page_heap.mapped_pages += page_count;
     page_heap.free_pages += page_count;
@@ -227,61 +486,176 @@ int pageheap_grow(size_t page_count)
 
 /*search buckets for span with >= requested pages*/
 static Span* find_suitable(size_t page_count) {
-    size_t idx = bucket_index(page_count);
-    if (idx < MAX_BUCKETS - 1) {
-        Span* head = page_heap.free_buckets[idx];
-        if (head) return head; /*in this bucket, all spans have same page_count*/
-        /*not found in this bucket, try larger buckets*/
-        for (size_t i = idx + 1; i < MAX_BUCKETS - 1; i++) {
-            Span* h = page_heap.free_buckets[i];
-            if (h) return h; 
-        }
-    }
-    /* last bucket: use skiplist lower_bound */
+    /*every span in a small bucket has exactly that bucket's page_count*/
+    Span* s = small_bucket_from(bucket_index(page_count));
+    if (s) return s;
     return large_bucket_lower_bound(&page_heap, page_count);
 }
 
-/*allocate a span; split if larger; grow if needed*/
-Span* span_alloc(size_t page_count)
+/*take page_count pages from the front of free span s; the rest stays free.
+ *called with the lock held; NULL if no record is left for the remainder*/
+static Span* span_carve(Span* s, size_t page_count)
 {
-    if (!page_heap.page_size) pageheap_init();
-    if (!page_count) return NULL;
-    pthread_mutex_lock(&page_heap_mutex);
-    Span* s = find_suitable(page_count);
-    if (!s){
-        size_t grow = page_count;
-        if (page_count < DEFAULT_GROW_PAGES && page_count < 32) grow = DEFAULT_GROW_PAGES;
-        if (pageheap_grow_nolock(grow) != 0){ pthread_mutex_unlock(&page_heap_mutex); return NULL; }
-        s = find_suitable(page_count);
-        if (!s){ pthread_mutex_unlock(&page_heap_mutex); return NULL; }
-    }
-    bucket_remove(s);
     if (s->page_count == page_count){
+        bucket_remove(s);
+        if (s->released) page_heap.released_pages -= page_count;
+        s->released = 0;
         s->in_use = 1;
+#ifdef DMALLOC_HUGEPAGE
+        hp_account(s, 1);
+#endif
         page_heap.free_pages -= s->page_count;
         page_heap.spans_free -= 1;
         page_heap.spans_in_use += 1;
-        pthread_mutex_unlock(&page_heap_mutex);
+        pagemap_set(s->start, s->page_count, s);
         return s;
     }
     size_t remain = s->page_count - page_count;
     void* remain_start = (void*)((uintptr_t)s->start + page_count * psize());
+    Span* r = span_create(remain_start, 0);
+    if (!r) return NULL;
+    bucket_remove(s);
+    /* the remainder keeps the released mark; its pages were not touched */
+    r->released = s->released;
+    r->zeroed = s->zeroed;
+    r->free_epoch = s->free_epoch;
+    if (s->released) page_heap.released_pages -= page_count;
+    s->released = 0;
     s->page_count = page_count;
     s->in_use = 1;
-    Span* r = span_create(remain_start, 0);
-    if (!r){ pthread_mutex_unlock(&page_heap_mutex); return NULL; }
+#ifdef DMALLOC_HUGEPAGE
+    hp_account(s, 1);
+#endif
     r->page_count = remain;
-    r->next_addr = s->next_addr;
-    r->prev_addr = s;
-    if (s->next_addr) s->next_addr->prev_addr = r;
-    s->next_addr = r;
+    pagemap_tag(r);
     bucket_insert(r);
     page_heap.spans_in_use += 1;
     page_heap.free_pages -= page_count;
+    pagemap_set(s->start, s->page_count, s);
+    return s;
+}
+
+/*find a free span of at least page_count pages, growing the heap once if needed*/
+static Span* find_or_grow(size_t page_count)
+{
+    Span* s = find_suitable(page_count);
+    if (s) return s;
+    size_t grow = page_count;
+    if (page_count < DEFAULT_GROW_PAGES && page_count < 32) grow = DEFAULT_GROW_PAGES;
+    if (pageheap_grow_nolock(grow) != 0) return NULL;
+    return find_suitable(page_count);
+}
+
+/*allocate a span; split if larger; grow if needed*/
+Span* span_alloc(size_t page_count)
+{
+    if (!page_heap.page_size) pageheap_init();
+    if (!page_count) return NULL;
+    pthread_mutex_lock(&page_heap_mutex);
+    Span* s = find_or_grow(page_count);
+    if (s) s = span_carve(s, page_count);
+    pthread_mutex_unlock(&page_heap_mutex);
+    return s;
+}
+
+/*allocate a span starting on an align_pages boundary. any free span of
+ *page_count + align_pages - 1 pages holds one, so the search stays a single
+ *bucket lookup; the pages in front of the boundary are split off as a free span*/
+Span* span_alloc_aligned(size_t page_count, size_t align_pages)
+{
+    if (!page_heap.page_size) pageheap_init();
+    if (!page_count || !align_pages || (align_pages & (align_pages - 1))) return NULL;
+    if (align_pages == 1) return span_alloc(page_count);
+    if (page_count > SIZE_MAX - align_pages) return NULL;
+    pthread_mutex_lock(&page_heap_mutex);
+    Span* s = find_or_grow(page_count + align_pages - 1);
+    if (!s){ pthread_mutex_unlock(&page_heap_mutex); return NULL; }
+    uintptr_t align = (uintptr_t)align_pages * psize();
+    uintptr_t start = (uintptr_t)s->start;
+    size_t lead = (size_t)((((start + align - 1) & ~(align - 1)) - start) / psize());
+    if (lead){
+        Span* h = span_create(s->start, 0);
+        if (!h){ pthread_mutex_unlock(&page_heap_mutex); return NULL; }
+        bucket_remove(s);
+        h->page_count = lead;
+        h->released = s->released;
+        h->zeroed = s->zeroed;
+        h->free_epoch = s->free_epoch;
+        s->start = (void*)(start + lead * psize());
+        s->page_count -= lead;
+        pagemap_tag(h);
+        bucket_insert(h);
+        pagemap_tag(s);
+        bucket_insert(s);
+        page_heap.spans_free += 1;
+    }
+    s = span_carve(s, page_count);
     pthread_mutex_unlock(&page_heap_mutex);
     return s;
 }
 
+/*grow in-use span s to page_count pages by taking the front of the free span
+ *right after it; -1 if that span is missing or too small*/
+int span_extend(Span* s, size_t page_count)
+{
+    if (!s || !s->in_use) return -1;
+    pthread_mutex_lock(&page_heap_mutex);
+    if (page_count <= s->page_count){ pthread_mutex_unlock(&page_heap_mutex); return 0; }
+    size_t extra = page_count - s->page_count;
+    Span* r = pagemap_get(((uintptr_t)s->start >> pageheap_pagemap_shift) + s->page_count);
+    if (!r || r->in_use || r->page_count < extra){
+        pthread_mutex_unlock(&page_heap_mutex);
+        return -1;
+    }
+    bucket_remove(r);
+    if (r->released) page_heap.released_pages -= extra;
+    if (r->page_count == extra){
+        meta_release(r);
+        page_heap.spans_free -= 1;
+    } else {
+        r->start = (uint8_t*)r->start + extra * psize();
+        r->page_count -= extra;
+        pagemap_tag(r);
+        bucket_insert(r);
+    }
+#ifdef DMALLOC_HUGEPAGE
+    hp_account(s, -1);
+#endif
+    s->page_count = page_count;
+#ifdef DMALLOC_HUGEPAGE
+    hp_account(s, 1);
+#endif
+    page_heap.free_pages -= extra;
+    pagemap_set(s->start, s->page_count, s);
+    pthread_mutex_unlock(&page_heap_mutex);
+    return 0;
+}
+
+/*cut in-use span s down to page_count pages; the tail is freed and merges
+ *with its right neighbor. -1 if no record is left for the tail*/
+int span_shrink(Span* s, size_t page_count)
+{
+    if (!s || !s->in_use || !page_count) return -1;
+    pthread_mutex_lock(&page_heap_mutex);
+    if (page_count >= s->page_count){ pthread_mutex_unlock(&page_heap_mutex); return 0; }
+    size_t tail = s->page_count - page_count;
+    Span* t = span_create((uint8_t*)s->start + page_count * psize(), 0);
+    if (!t){ pthread_mutex_unlock(&page_heap_mutex); return -1; }
+#ifdef DMALLOC_HUGEPAGE
+    hp_account(s, -1);
+#endif
+    s->page_count = page_count;
+#ifdef DMALLOC_HUGEPAGE
+    hp_account(s, 1);
+#endif
+    t->page_count = tail;
+    page_heap.free_pages += tail;
+    page_heap.spans_free += 1;
+    coalesce_neighbors(t);
+    pthread_mutex_unlock(&page_heap_mutex);
+    return 0;
+}
+
 /*mark span free, update stats, and coalesce neighbors*/
 void span_free(Span* s)
 {
@@ -289,6 +663,11 @@ void span_free(Span* s)
     if (!s->in_use) return;
     pthread_mutex_lock(&page_heap_mutex);
     s->in_use = 0;
+    s->owner = NULL;
+    s->zeroed = 0;
+#ifdef DMALLOC_HUGEPAGE
+    hp_account(s, -1);
+#endif
     page_heap.spans_in_use -= 1;
     page_heap.free_pages += s->page_count;
     page_heap.spans_free += 1;
@@ -319,84 +698,200 @@ PageHeapStats pageheap_stats(void)
     st.free_pages = page_heap.free_pages;
     st.spans_in_use = page_heap.spans_in_use;
     st.spans_free = page_heap.spans_free;
+    st.released_pages = page_heap.released_pages;
+    st.meta_bytes = page_heap.span_records * sizeof(Span);
+    st.meta_bytes_saved = page_heap.span_records * (sizeof(SkiplistSpan) - sizeof(Span));
     return st;
 }
 
-/*release fully free spans with page_count >= min_pages using munmap; returns released pages*/
+#ifdef DMALLOC_HUGEPAGE
+/*shrink a free span that is out of its bucket to the whole hugepages it
+ *covers, filing the ragged ends as free spans; 0 if it covers none*/
+static size_t hp_trim(Span* s)
+{
+    uintptr_t lo;
+    size_t n = hp_inner(s->start, s->page_count, &lo);
+    if (!n) return 0;
+    size_t head = (lo - (uintptr_t)s->start) / psize();
+    size_t tail = s->page_count - head - n;
+    Span* h = head ? span_create(s->start, 0) : NULL;
+    Span* t = tail ? span_create((void*)(lo + n * psize()), 0) : NULL;
+    if ((head && !h) || (tail && !t)){
+        if (h) meta_release(h);
+        if (t) meta_release(t);
+        return 0;
+    }
+    if (h){
+        h->released = s->released;
+        h->zeroed = s->zeroed;
+        h->free_epoch = s->free_epoch;
+        h->page_count = head;
+        pagemap_tag(h);
+        bucket_insert(h);
+        page_heap.spans_free += 1;
+    }
+    if (t){
+        t->released = s->released;
+        t->zeroed = s->zeroed;
+        t->free_epoch = s->free_epoch;
+        t->page_count = tail;
+        pagemap_tag(t);
+        bucket_insert(t);
+        page_heap.spans_free += 1;
+    }
+    s->start = (void*)lo;
+    s->page_count = n;
+    return n;
+}
+#endif
+
+/*release fully free spans with page_count >= min_pages to the OS; arena ranges
+ *are decommitted and kept for reuse, others are munmap'ed. returns released pages*/
 size_t pageheap_release_empty_spans(size_t min_pages)
 {
     if (!page_heap.page_size) pageheap_init();
     if (min_pages == 0) min_pages = 1;
     size_t released_pages = 0;
-    typedef struct { void* addr; size_t bytes; } Rel;
-    Rel* rels = NULL; size_t cap = 0, n = 0;
+    Span* batch = NULL;
     pthread_mutex_lock(&page_heap_mutex);
-    Span* cur = page_heap.addr_head;
+    Span* cur = free_iter_first(min_pages);
     while (cur){
-        Span* next = cur->next_addr; /* save next since cur may be removed */
-        if (!cur->in_use && cur->page_count >= min_pages){
-            size_t bytes = cur->page_count * psize();
-            /* unlink from bucket and addr list */
-            bucket_remove(cur);
-            addr_remove(cur);
-            /* update stats */
-            page_heap.mapped_pages -= cur->page_count;
-            page_heap.free_pages   -= cur->page_count;
-            page_heap.spans_free   -= 1;
-            released_pages         += cur->page_count;
-            /* record for system call outside lock */
-            if (n == cap){
-                size_t newcap = cap ? cap * 2 : 16;
-                Rel* tmp = (Rel*)realloc(rels, newcap * sizeof(Rel));
-                if (tmp){ rels = tmp; cap = newcap; }
-            }
-            if (n < cap){ rels[n].addr = cur->start; rels[n].bytes = bytes; n++; }
-            else {
-                /* fallback: perform munmap while holding lock if allocation failed */
-                (void)munmap(cur->start, bytes);
-            }
-            /* recycle metadata */
-            meta_release(cur);
+        Span* next = free_iter_next(cur); /* save next since cur is removed */
+        if (cur->page_count < min_pages){ cur = next; continue; }
+        bucket_remove(cur);
+#ifdef DMALLOC_HUGEPAGE
+        /* only whole hugepages go back; the ragged ends stay free in the heap */
+        if (in_arena(cur->start) && !hp_trim(cur)){
+            bucket_insert(cur);
+            cur = next;
+            continue;
         }
+#endif
+        if (cur->released) page_heap.released_pages -= cur->page_count;
+        /* update stats */
+        page_heap.mapped_pages -= cur->page_count;
+        page_heap.free_pages   -= cur->page_count;
+        page_heap.spans_free   -= 1;
+        released_pages         += cur->page_count;
+        /* forget pages before the range can be reused by other mappings */
+        pagemap_set(cur->start, cur->page_count, NULL);
+        /* chain for the system calls outside the lock */
+        cur->next_free_addr = batch;
+        batch = cur;
         cur = next;
     }
     pthread_mutex_unlock(&page_heap_mutex);
-    /* perform system calls outside lock */
-    for (size_t i = 0; i < n; i++) (void)munmap(rels[i].addr, rels[i].bytes);
-    free(rels);
+    if (!batch) return 0;
+    for (Span* s = batch; s; s = s->next_free_addr){
+        size_t bytes = s->page_count * psize();
+        if (in_arena(s->start)) arena_decommit(s->start, bytes);
+        else (void)munmap(s->start, bytes);
+    }
+    /* decommitted ranges become reusable only now, so growth never races the calls above */
+    pthread_mutex_lock(&page_heap_mutex);
+    while (batch){
+        Span* s = batch;
+        batch = s->next_free_addr;
+        if (in_arena(s->start)) arena_return(s);
+        else meta_release(s);
+    }
+    pthread_mutex_unlock(&page_heap_mutex);
     return released_pages;
 }
 
-/*soft reclaim free spans with page_count >= min_pages using madvise(DONTNEED); returns advised pages*/
-size_t pageheap_madvise_idle_spans(size_t min_pages)
+/*in_use value of a free span pulled out of its bucket while it is advised*/
+#define SPAN_ADVISING (3)
+
+/*madvise(DONTNEED) free spans with page_count >= min_pages that are not yet
+ *released, stopping after about max_pages; with idle_only, spans that became
+ *free in the current epoch are left alone. The spans leave the free lists
+ *while the calls run outside the lock, so nobody can allocate them meanwhile.
+ *returns advised pages*/
+static size_t advise_free_spans(size_t min_pages, size_t max_pages, int idle_only)
 {
-    if (!page_heap.page_size) pageheap_init();
-    if (min_pages == 0) min_pages = 1;
     size_t advised_pages = 0;
-    typedef struct { void* addr; size_t bytes; } Adv;
-    Adv* advs = NULL; size_t cap = 0, n = 0;
+    Span* batch = NULL;
     pthread_mutex_lock(&page_heap_mutex);
-    Span* cur = page_heap.addr_head;
-    while (cur){
-        Span* next = cur->next_addr;
-        if (!cur->in_use && cur->page_count >= min_pages){
-            size_t bytes = cur->page_count * psize();
-            advised_pages += cur->page_count;
-            if (n == cap){
-                size_t newcap = cap ? cap * 2 : 16;
-                Adv* tmp = (Adv*)realloc(advs, newcap * sizeof(Adv));
-                if (tmp){ advs = tmp; cap = newcap; }
-            }
-            if (n < cap){ advs[n].addr = cur->start; advs[n].bytes = bytes; n++; }
-            else {
-                /* fallback: perform madvise while holding lock */
-                (void)madvise(cur->start, bytes, MADV_DONTNEED);
-            }
+    Span* cur = free_iter_first(min_pages);
+    while (cur && advised_pages < max_pages){
+        Span* next = free_iter_next(cur);
+        if (cur->page_count < min_pages || cur->released ||
+            (idle_only && cur->free_epoch == page_heap.epoch)){
+            cur = next;
+            continue;
+        }
+        bucket_remove(cur);
+#ifdef DMALLOC_HUGEPAGE
+        /* partly free hugepages stay intact; the ragged ends stay free and unreleased */
+        if (in_arena(cur->start) && !hp_trim(cur)){
+            bucket_insert(cur);
+            cur = next;
+            continue;
         }
+#endif
+        cur->in_use = SPAN_ADVISING;
+        cur->next_free_addr = batch;
+        batch = cur;
+        advised_pages += cur->page_count;
         cur = next;
     }
+    if (idle_only) page_heap.epoch++;
+    pthread_mutex_unlock(&page_heap_mutex);
+    if (!batch) return 0;
+    /* the spans stay SPAN_ADVISING until the lock is back, so a neighbor being
+     * freed never mistakes one for a free span; failures go on a list of their own */
+    Span* failed = NULL;
+    Span* done = NULL;
+    while (batch){
+        Span* sp = batch;
+        batch = sp->next_free_addr;
+        /* anonymous pages read back as zero; the span is still ours alone */
+        if (madvise(sp->start, sp->page_count * psize(), MADV_DONTNEED) == 0){
+            sp->zeroed = 1;
+            sp->next_free_addr = done;
+            done = sp;
+        } else {
+            sp->next_free_addr = failed;
+            failed = sp;
+        }
+    }
+    pthread_mutex_lock(&page_heap_mutex);
+    for (Span* sp = failed; sp; sp = failed){
+        failed = sp->next_free_addr;
+        advised_pages -= sp->page_count;
+        sp->in_use = 0;
+        /* neighbors freed meanwhile merge back in */
+        coalesce_neighbors(sp);
+    }
+    for (Span* sp = done; sp; sp = done){
+        done = sp->next_free_addr;
+        sp->released = 1;
+        page_heap.released_pages += sp->page_count;
+        sp->in_use = 0;
+#ifdef DMALLOC_HUGEPAGE
+        /* merging with the dirty ragged ends would drop the released mark again */
+        sp->free_epoch = page_heap.epoch;
+        pagemap_tag(sp);
+        bucket_insert(sp);
+#else
+        coalesce_neighbors(sp);
+#endif
+    }
     pthread_mutex_unlock(&page_heap_mutex);
-    for (size_t i = 0; i < n; i++) (void)madvise(advs[i].addr, advs[i].bytes, MADV_DONTNEED);
-    free(advs);
     return advised_pages;
 }
+
+/*soft reclaim free spans with page_count >= min_pages using madvise(DONTNEED); returns advised pages*/
+size_t pageheap_madvise_idle_spans(size_t min_pages)
+{
+    if (!page_heap.page_size) pageheap_init();
+    if (min_pages == 0) min_pages = 1;
+    return advise_free_spans(min_pages, SIZE_MAX, 0);
+}
+
+size_t pageheap_scavenge(size_t max_pages)
+{
+    if (!page_heap.page_size) pageheap_init();
+    if (!max_pages) return 0;
+    return advise_free_spans(1, max_pages, 1);
+}
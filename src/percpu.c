@@ -0,0 +1,80 @@
+#include "../include/percpu.h"
+#include "../include/size_classes.h"
+
+#ifdef PERCPU_SUPPORTED
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+_Static_assert(SIZE_CLASS_COUNT * sizeof(uint32_t) <= PERCPU_HDR_BYTES,
+               "per-CPU header too small for the size-class table");
+
+uint8_t* percpu_base;
+uint8_t  percpu_shift;
+uint32_t percpu_begin[SIZE_CLASS_COUNT];
+uint32_t percpu_end[SIZE_CLASS_COUNT];
+
+/* glibc >= 2.35 registers rseq for every thread and exports where it lives */
+extern const ptrdiff_t __rseq_offset __attribute__((weak));
+extern const unsigned int __rseq_size __attribute__((weak));
+
+/* kernel ABI struct rseq; only used when libc did not register one */
+typedef struct {
+    uint32_t cpu_id_start;
+    uint32_t cpu_id;
+    uint64_t rseq_cs;
+    uint32_t flags;
+    uint32_t pad[3];
+} RseqArea;
+
+static __thread RseqArea rseq_area __attribute__((aligned(32), tls_model("initial-exec"))) = { 0, (uint32_t)-1, 0, 0, {0} };
+
+int percpu_init(void)
+{
+    if (percpu_base) return 0;
+    long ncpu = sysconf(_SC_NPROCESSORS_CONF);
+    if (ncpu <= 0) return -1;
+
+    /* each class holds up to 2*batch objects, the same bound as a thread cache */
+    uint32_t slots = 0;
+    for (int sc = 0; sc < SIZE_CLASS_COUNT; sc++){
+        percpu_begin[sc] = slots;
+        slots += 2u * size_class_info[sc].batch;
+        percpu_end[sc] = slots;
+    }
+    /* power-of-two stride: a shift locates the slab and CPUs never share a page */
+    size_t need = PERCPU_HDR_BYTES + (size_t)slots * sizeof(void*);
+    uint8_t shift = 12;
+    while (((size_t)1 << shift) < need) shift++;
+    size_t stride = (size_t)1 << shift;
+
+    void* p = mmap(NULL, stride * (size_t)ncpu, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (p == MAP_FAILED) return -1;
+    for (long cpu = 0; cpu < ncpu; cpu++){
+        uint32_t* hdr = (uint32_t*)((uint8_t*)p + (size_t)cpu * stride);
+        for (int sc = 0; sc < SIZE_CLASS_COUNT; sc++) hdr[sc] = percpu_begin[sc];
+    }
+    percpu_shift = shift;
+    percpu_base = p;
+    return 0;
+}
+
+void* percpu_register(void)
+{
+    if (!percpu_base) return NULL;
+    if (&__rseq_size != NULL && __rseq_size != 0)
+        return (uint8_t*)__builtin_thread_pointer() + __rseq_offset;
+#ifdef SYS_rseq
+    if (syscall(SYS_rseq, &rseq_area, sizeof(rseq_area), 0, PERCPU_RSEQ_SIG) == 0)
+        return &rseq_area;
+#endif
+    return NULL;
+}
+
+#else
+
+int percpu_init(void){ return -1; }
+void* percpu_register(void){ return NULL; }
+
+#endif
@@ -5,6 +5,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/time.h>
+#include <unistd.h>
+#include <malloc.h>
 
 typedef void* (*alloc_fn)(size_t);
 typedef void  (*free_fn)(void*);
@@ -26,6 +28,118 @@ static double run_once(alloc_fn af, free_fn ff, size_t sz, int count){
     return t1 - t0;
 }
 
+/* resident set size from /proc/self/statm; 0 when unavailable */
+static size_t rss_bytes(void){
+    FILE* f = fopen("/proc/self/statm", "r");
+    if (!f) return 0;
+    unsigned long size = 0, resident = 0;
+    int ok = fscanf(f, "%lu %lu", &size, &resident) == 2;
+    fclose(f);
+    return ok ? (size_t)resident * (size_t)sysconf(_SC_PAGESIZE) : 0;
+}
+
+/* bytes of resident memory per live object (payload + allocator overhead) */
+static void bench_footprint(const char* name, alloc_fn af, free_fn ff, size_t sz){
+    const int count = 200000;
+    void** arr = (void**)malloc(sizeof(void*) * count);
+    memset(arr, 1, sizeof(void*) * count); /* fault in the pointer array up front */
+    size_t before = rss_bytes();
+    for (int i = 0; i < count; i++){ arr[i] = af(sz); if (!arr[i]) { fprintf(stderr, "alloc failed\n"); exit(1);} memset(arr[i], 0x5A, sz); }
+    size_t after = rss_bytes();
+    for (int i = 0; i < count; i++){ ff(arr[i]); }
+    free(arr);
+    /* hand freed pages back so the next footprint run starts from a clean RSS */
+    malloc_trim(0);
+    pageheap_release_empty_spans(1);
+    double per = after > before ? (double)(after - before) / count : 0.0;
+    printf("%s FOOTPRINT size=%zu count=%d bytes/obj=%.1f\n", name, sz, count, per);
+}
+
+typedef void* (*calloc_fn)(size_t, size_t);
+
+static void* dm_calloc_naive(size_t n, size_t sz){ void* p = dmalloc(n * sz); if (p) memset(p, 0, n * sz); return p; }
+
+/* zeroed buffers that are only touched sparsely: time and resident growth */
+static void bench_calloc(const char* name, calloc_fn cf, size_t sz){
+    const int count = 256;
+    void* arr[count];
+    size_t before = rss_bytes();
+    double t0 = now_ms();
+    for (int i = 0; i < count; i++){ arr[i] = cf(1, sz); if (!arr[i]) { fprintf(stderr, "alloc failed\n"); exit(1);} ((char*)arr[i])[0] = 1; }
+    double t1 = now_ms();
+    size_t after = rss_bytes();
+    for (int i = 0; i < count; i++){ dfree(arr[i]); }
+    pageheap_release_empty_spans(1);
+    printf("%s CALLOC size=%zu count=%d time=%.2fms rss=%.1fMiB\n", name, sz, count, t1 - t0,
+           after > before ? (after - before) / 1048576.0 : 0.0);
+}
+
+typedef void* (*realloc_fn)(void*, size_t);
+
+static void* sys_realloc(void* p, size_t n){ return realloc(p, n); }
+
+/* a buffer grown step by step to 64 MiB, writing each new step: copies dominate
+ * unless realloc grows in place */
+static void bench_realloc(const char* name, realloc_fn rf, free_fn ff){
+    const size_t step = 64 * 1024, cap = 64u << 20;
+    char* p = NULL;
+    double t0 = now_ms();
+    for (size_t n = step; n <= cap; n += step){
+        p = (char*)rf(p, n);
+        if (!p) { fprintf(stderr, "alloc failed\n"); exit(1); }
+        memset(p + n - step, 0x5A, step);
+    }
+    double t1 = now_ms();
+    ff(p);
+    printf("%s REALLOC step=%zu to=%zu reallocs=%zu time=%.2fms\n", name, step, cap, cap / step, t1 - t0);
+}
+
+/* a parser's pattern: many same-sized nodes allocated at once and freed
+ * together, either one call per node or one call per round */
+static void bench_batch(size_t sz, int nodes){
+    const int rounds = 2000;
+    void** arr = (void**)malloc(sizeof(void*) * nodes);
+    double t0 = now_ms();
+    for (int r = 0; r < rounds; r++){
+        for (int i = 0; i < nodes; i++){ arr[i] = dmalloc(sz); if (!arr[i]) { fprintf(stderr, "alloc failed\n"); exit(1);} *(char*)arr[i] = 1; }
+        for (int i = 0; i < nodes; i++) dfree(arr[i]);
+    }
+    double t1 = now_ms();
+    for (int r = 0; r < rounds; r++){
+        if (dmalloc_batch(sz, arr, nodes) != (size_t)nodes) { fprintf(stderr, "alloc failed\n"); exit(1); }
+        for (int i = 0; i < nodes; i++) *(char*)arr[i] = 1;
+        dfree_batch(arr, nodes);
+    }
+    double t2 = now_ms();
+    free(arr);
+    double ops = 2.0 * rounds * nodes;
+    printf("dmalloc-loop BATCH size=%zu nodes=%d ns/op=%.2f\n", sz, nodes, (t1 - t0) * 1e6 / ops);
+    printf("dmalloc-batch BATCH size=%zu nodes=%d ns/op=%.2f\n", sz, nodes, (t2 - t1) * 1e6 / ops);
+}
+
+/* request-scoped data: thousands of mixed small objects, then all dropped,
+ * through dmalloc/dfree or one arena per request */
+static void bench_arena(int objs){
+    const int requests = 2000;
+    void** arr = (void**)malloc(sizeof(void*) * objs);
+    double t0 = now_ms();
+    for (int r = 0; r < requests; r++){
+        for (int i = 0; i < objs; i++){ size_t sz = 16 + (i * 37) % 240; arr[i] = dmalloc(sz); if (!arr[i]) { fprintf(stderr, "alloc failed\n"); exit(1);} *(char*)arr[i] = 1; }
+        for (int i = 0; i < objs; i++) dfree(arr[i]);
+    }
+    double t1 = now_ms();
+    for (int r = 0; r < requests; r++){
+        DmallocArena* a = dmalloc_arena_create();
+        if (!a) { fprintf(stderr, "alloc failed\n"); exit(1); }
+        for (int i = 0; i < objs; i++){ size_t sz = 16 + (i * 37) % 240; char* p = dmalloc_arena_alloc(a, sz); if (!p) { fprintf(stderr, "alloc failed\n"); exit(1);} *p = 1; }
+        dmalloc_arena_destroy(a);
+    }
+    double t2 = now_ms();
+    free(arr);
+    printf("dmalloc ARENA objs=%d requests=%d ns/obj=%.2f\n", objs, requests, (t1 - t0) * 1e6 / ((double)objs * requests));
+    printf("dmalloc-arena ARENA objs=%d requests=%d ns/obj=%.2f\n", objs, requests, (t2 - t1) * 1e6 / ((double)objs * requests));
+}
+
 typedef struct { alloc_fn af; free_fn ff; size_t sz; int count; double ms; } Arg;
 
 static void* worker(void* p){ Arg* a = (Arg*)p; a->ms = run_once(a->af, a->ff, a->sz, a->count); return NULL; }
@@ -67,6 +181,27 @@ int main(){
     size_t small = 32;
     size_t medium = 512;
     size_t large = ps * 8 + 128;
+    size_t xlarge = MAX_SMALL + ps; /* page heap span, beyond the size classes */
+
+    /* before anything leaves dirty blocks behind; dcalloc first because the
+     * blocks freed by the memset run stay cached dirty */
+    bench_calloc("dmalloc", dcalloc, 128 * ps);
+    bench_calloc("dmalloc-memset", dm_calloc_naive, 128 * ps);
+
+    bench_realloc("glibc", sys_realloc, sys_free);
+    bench_realloc("dmalloc", drealloc, dm_free);
+
+    bench_batch(small, 512);
+    bench_batch(medium, 512);
+    bench_batch(small, 8192);
+
+    bench_arena(1000);
+    bench_arena(10000);
+
+    bench_footprint("glibc", sys_alloc, sys_free, 16);
+    bench_footprint("dmalloc", dm_alloc, dm_free, 16);
+    bench_footprint("glibc", sys_alloc, sys_free, small);
+    bench_footprint("dmalloc", dm_alloc, dm_free, small);
 
     bench_st("glibc", sys_alloc, sys_free, small);
     bench_st("dmalloc", dm_alloc, dm_free, small);
@@ -74,6 +209,8 @@ int main(){
     bench_st("dmalloc", dm_alloc, dm_free, medium);
     bench_st("glibc", sys_alloc, sys_free, large);
     bench_st("dmalloc", dm_alloc, dm_free, large);
+    bench_st("glibc", sys_alloc, sys_free, xlarge);
+    bench_st("dmalloc", dm_alloc, dm_free, xlarge);
 
     bench_mt("glibc", sys_alloc, sys_free, small);
     bench_mt("dmalloc", dm_alloc, dm_free, small);
@@ -81,5 +218,7 @@ int main(){
     bench_mt("dmalloc", dm_alloc, dm_free, medium);
     bench_mt("glibc", sys_alloc, sys_free, large);
     bench_mt("dmalloc", dm_alloc, dm_free, large);
+    bench_mt("glibc", sys_alloc, sys_free, xlarge);
+    bench_mt("dmalloc", dm_alloc, dm_free, xlarge);
     return 0;
 }
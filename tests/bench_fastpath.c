@@ -0,0 +1,121 @@
+#include "../include/dmalloc.h"
+#include "../include/page_heap.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+static inline uint64_t cycles(void){ return __rdtsc(); }
+#else
+static inline uint64_t cycles(void){ return 0; }
+#endif
+
+typedef void* (*alloc_fn)(size_t);
+typedef void  (*free_fn)(void*);
+
+static void* sys_alloc(size_t n){ return malloc(n); }
+static void  sys_free(void* p){ free(p); }
+static void* dm_alloc(size_t n){ return dmalloc(n); }
+static void  dm_free(void* p){ dfree(p); }
+static void* dm_alloc_inline(size_t n){ return dmalloc_inline(n); }
+static void  dm_free_inline(void* p){ dfree_inline(p); }
+
+static double now_ns(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* alloc/free pairs that always hit the thread cache after warm-up */
+static void bench_hit(const char* name, alloc_fn af, free_fn ff, size_t sz){
+    const long iters = 20000000;
+    void* volatile sink;
+    for (int i = 0; i < 1000; i++){ void* p = af(sz); ff(p); }
+    double t0 = now_ns();
+    uint64_t c0 = cycles();
+    for (long i = 0; i < iters; i++){
+        void* p = af(sz);
+        sink = p;
+        ff(p);
+    }
+    uint64_t c1 = cycles();
+    double t1 = now_ns();
+    (void)sink;
+    printf("%s HIT size=%zu pairs=%ld ns/op=%.2f cycles/op=%.1f\n", name, sz, iters,
+           (t1 - t0) / (2.0 * iters), (double)(c1 - c0) / (2.0 * iters));
+}
+
+/* bursts larger than the thread cache: every round refills and flushes
+ * several batches, so this times the path behind the cache */
+#define BURST 4096
+static void bench_burst(const char* name, alloc_fn af, free_fn ff, size_t sz){
+    static void* objs[BURST];
+    const long rounds = 2000;
+    double t0 = now_ns();
+    for (long r = 0; r < rounds; r++){
+        for (int i = 0; i < BURST; i++) objs[i] = af(sz);
+        for (int i = 0; i < BURST; i++) ff(objs[i]);
+    }
+    double t1 = now_ns();
+    printf("%s BURST size=%zu burst=%d rounds=%ld ns/op=%.2f\n", name, sz, BURST, rounds,
+           (t1 - t0) / (2.0 * BURST * rounds));
+}
+
+static uint64_t rng = 0x9e3779b97f4a7c15ULL;
+static uint32_t rnd(void){
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    return (uint32_t)rng;
+}
+
+/* frees of random objects from a large live set, after a sweep that evicts
+ * them: the span lookup of a plain free misses, a sized free skips it. Each
+ * round frees few enough to stay in the thread cache, then takes them back */
+#define COLD (1u << 18)
+#define COLD_PICK 64
+static void bench_cold(size_t sz){
+    static void* objs[COLD];
+    static char sweep[32u << 20];
+    const int rounds = 400;
+    uint32_t pick[COLD_PICK];
+    double ns[2] = { 0, 0 };
+    for (size_t i = 0; i < COLD; i++){
+        objs[i] = dmalloc(sz);
+        *(char*)objs[i] = 1;
+    }
+    for (int r = 0; r < 2 * rounds; r++){
+        int sized = r & 1;
+        for (int k = 0; k < COLD_PICK; k++){
+            pick[k] = rnd() % COLD;
+            for (int m = 0; m < k; m++) if (pick[m] == pick[k]){ k--; break; }
+        }
+        for (size_t i = 0; i < sizeof(sweep); i += 64) sweep[i]++;
+        double t0 = now_ns();
+        if (sized) for (int k = 0; k < COLD_PICK; k++) dfree_sized_inline(objs[pick[k]], sz);
+        else for (int k = 0; k < COLD_PICK; k++) dfree_inline(objs[pick[k]]);
+        ns[sized] += now_ns() - t0;
+        for (int k = 0; k < COLD_PICK; k++) objs[pick[k]] = dmalloc(sz);
+    }
+    for (size_t i = 0; i < COLD; i++) dfree(objs[i]);
+    printf("dmalloc COLD_FREE size=%zu live=%u ns/op=%.2f\n", sz, COLD, ns[0] / (rounds * COLD_PICK));
+    printf("dmalloc_sized COLD_FREE size=%zu live=%u ns/op=%.2f\n", sz, COLD, ns[1] / (rounds * COLD_PICK));
+}
+
+int main(){
+    pageheap_init();
+    size_t sizes[] = { 16, 256, 4096 };
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++){
+        bench_hit("glibc", sys_alloc, sys_free, sizes[i]);
+        bench_hit("dmalloc", dm_alloc, dm_free, sizes[i]);
+        bench_hit("dmalloc_inline", dm_alloc_inline, dm_free_inline, sizes[i]);
+    }
+    for (size_t i = 0; i < 2; i++){
+        bench_burst("glibc", sys_alloc, sys_free, sizes[i]);
+        bench_burst("dmalloc", dm_alloc, dm_free, sizes[i]);
+    }
+    bench_cold(64);
+    bench_cold(1024);
+    return 0;
+}
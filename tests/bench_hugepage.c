@@ -0,0 +1,95 @@
+#include "../include/dmalloc.h"
+#include "../include/page_heap.h"
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* THP coverage of the heap: fill it with mixed small objects, report how much
+ * of the resident memory is backed by transparent hugepages according to
+ * /proc/self/smaps, and time random reads across it (dTLB bound). Build with
+ * -DDMALLOC_HUGEPAGE to compare against the hugepage-aware mode. */
+
+#define OBJS (1u << 20)
+
+static void* objs[OBJS];
+
+static double now_ns(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static uint64_t rng = 0x9e3779b97f4a7c15ULL;
+static uint32_t rnd(void){
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    return (uint32_t)rng;
+}
+
+/* sum Rss and AnonHugePages over all mappings, in KiB */
+static void smaps(size_t* rss_kb, size_t* huge_kb){
+    *rss_kb = *huge_kb = 0;
+    FILE* f = fopen("/proc/self/smaps", "r");
+    if (!f) return;
+    char line[256];
+    size_t v;
+    while (fgets(line, sizeof(line), f)){
+        if (sscanf(line, "Rss: %zu kB", &v) == 1) *rss_kb += v;
+        else if (sscanf(line, "AnonHugePages: %zu kB", &v) == 1) *huge_kb += v;
+    }
+    fclose(f);
+}
+
+static void report(const char* phase){
+    size_t rss, huge;
+    smaps(&rss, &huge);
+    printf("THP %s rss=%.1fMiB anon_huge=%.1fMiB coverage=%.1f%%\n", phase,
+           rss / 1024.0, huge / 1024.0, rss ? 100.0 * huge / rss : 0.0);
+}
+
+static double random_reads(void){
+    const long iters = 10000000;
+    volatile uint8_t sink = 0;
+    double t0 = now_ns();
+    for (long i = 0; i < iters; i++){
+        uint8_t* p = (uint8_t*)objs[rnd() & (OBJS - 1)];
+        if (p) sink += *p;
+    }
+    double t1 = now_ns();
+    (void)sink;
+    return (t1 - t0) / iters;
+}
+
+int main(){
+#ifdef DMALLOC_HUGEPAGE
+    const char* mode = "hugepage";
+#else
+    const char* mode = "default";
+#endif
+    printf("THP mode=%s\n", mode);
+    for (size_t i = 0; i < OBJS; i++){
+        size_t sz = 64u << (rnd() % 6); /* 64 B .. 2 KiB */
+        objs[i] = dmalloc(sz);
+        assert(objs[i]);
+        memset(objs[i], 1, sz);
+    }
+    report("filled");
+    printf("THP random_read objs=%u ns/op=%.1f\n", OBJS, random_reads());
+
+    /* free most objects, release what is idle, and check coverage survives */
+    for (size_t i = 0; i < OBJS; i++){
+        if (rnd() % 8){
+            dfree(objs[i]);
+            objs[i] = NULL;
+        }
+    }
+    size_t released = pageheap_release_empty_spans(1);
+    printf("THP released_pages=%zu\n", released);
+    report("after_release");
+    printf("THP random_read objs=%u ns/op=%.1f\n", OBJS / 8, random_reads());
+    return 0;
+}
@@ -0,0 +1,101 @@
+#include "../include/page_heap.h"
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+/* page heap operations on a heavily fragmented heap: >100k live spans with a
+ * free one-page hole between each pair, so every free has free neighbors to
+ * merge and the one-page bucket holds tens of thousands of spans */
+
+#define SPANS (1u << 17)
+#define LARGE_HOLES 4096
+
+static double now_ns(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static uint64_t rng = 0x9e3779b97f4a7c15ULL;
+static uint32_t rnd(void){
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    return (uint32_t)rng;
+}
+
+static Span* spans[SPANS];
+static uint32_t order[SPANS / 2];
+
+/* carve SPANS one-page spans out of one mapping and free every other one */
+static void fragment(void){
+    assert(pageheap_grow(SPANS) == 0);
+    for (size_t i = 0; i < SPANS; i++){
+        spans[i] = span_alloc(1);
+        assert(spans[i]);
+    }
+    for (size_t i = 0; i < SPANS; i += 2){
+        span_free(spans[i]);
+        spans[i] = NULL;
+    }
+}
+
+int main(){
+    pageheap_init();
+    fragment();
+    PageHeapStats st = pageheap_stats();
+    printf("PAGEHEAP setup spans_in_use=%zu spans_free=%zu meta_bytes=%zu meta_bytes_saved=%zu\n",
+           st.spans_in_use, st.spans_free, st.meta_bytes, st.meta_bytes_saved);
+
+    /* free the survivors in random order: each one merges with its neighbors */
+    for (size_t i = 0; i < SPANS / 2; i++) order[i] = (uint32_t)(2 * i + 1);
+    for (size_t i = SPANS / 2 - 1; i > 0; i--){
+        size_t j = rnd() % (i + 1);
+        uint32_t t = order[i]; order[i] = order[j]; order[j] = t;
+    }
+    double t0 = now_ns();
+    for (size_t i = 0; i < SPANS / 2; i++) span_free(spans[order[i]]);
+    double t1 = now_ns();
+    st = pageheap_stats();
+    assert(st.spans_in_use == 0);
+    printf("PAGEHEAP free_coalesce spans=%u ns/op=%.1f\n", SPANS / 2, (t1 - t0) / (SPANS / 2));
+    pageheap_release_empty_spans(1);
+
+    /* steady churn: free a random live span, allocate a replacement */
+    fragment();
+    const long iters = 1000000;
+    t0 = now_ns();
+    for (long i = 0; i < iters; i++){
+        size_t k = 2 * (rnd() % (SPANS / 2)) + 1;
+        span_free(spans[k]);
+        spans[k] = span_alloc(1);
+        assert(spans[k]);
+    }
+    t1 = now_ns();
+    printf("PAGEHEAP churn spans=%u pairs=%ld ns/op=%.1f\n", SPANS / 2, iters, (t1 - t0) / (2.0 * iters));
+    for (size_t i = 0; i < SPANS; i++){
+        if (spans[i]) span_free(spans[i]);
+        spans[i] = NULL;
+    }
+    pageheap_release_empty_spans(1);
+
+    /* fit among many large free spans: holes of 64..319 pages pinned apart by
+     * one-page spans, then alloc/free pairs of random large sizes */
+    for (size_t i = 0; i < LARGE_HOLES; i++){
+        spans[2 * i] = span_alloc(64 + rnd() % 256);
+        spans[2 * i + 1] = span_alloc(1);
+        assert(spans[2 * i] && spans[2 * i + 1]);
+    }
+    for (size_t i = 0; i < LARGE_HOLES; i++) span_free(spans[2 * i]);
+    t0 = now_ns();
+    for (long i = 0; i < iters; i++){
+        Span* s = span_alloc(64 + rnd() % 256);
+        assert(s);
+        span_free(s);
+    }
+    t1 = now_ns();
+    printf("PAGEHEAP large_fit holes=%u pairs=%ld ns/op=%.1f\n", LARGE_HOLES, iters, (t1 - t0) / (2.0 * iters));
+    return 0;
+}
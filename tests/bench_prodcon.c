@@ -0,0 +1,97 @@
+#include "../include/dmalloc.h"
+#include "../include/page_heap.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+typedef void* (*alloc_fn)(size_t);
+typedef void  (*free_fn)(void*, size_t);
+
+static void* sys_alloc(size_t n){ return malloc(n); }
+static void  sys_free(void* p, size_t n){ (void)n; free(p); }
+static void* dm_alloc(size_t n){ return dmalloc(n); }
+static void  dm_free(void* p, size_t n){ (void)n; dfree(p); }
+static void  dm_free_sized(void* p, size_t n){ dfree_sized(p, n); }
+
+static double now_ms(){ struct timeval tv; gettimeofday(&tv, NULL); return tv.tv_sec*1000.0 + tv.tv_usec/1000.0; }
+
+static size_t rss_bytes(void){
+    FILE* f = fopen("/proc/self/statm", "r");
+    if (!f) return 0;
+    unsigned long size = 0, resident = 0;
+    int ok = fscanf(f, "%lu %lu", &size, &resident) == 2;
+    fclose(f);
+    return ok ? (size_t)resident * (size_t)sysconf(_SC_PAGESIZE) : 0;
+}
+
+/* single-producer single-consumer ring between one allocating and one freeing thread */
+#define RING_CAP 4096
+typedef struct {
+    void* slots[RING_CAP];
+    _Atomic size_t head; /* next slot to consume */
+    _Atomic size_t tail; /* next slot to produce */
+    alloc_fn af; free_fn ff; size_t sz; int count;
+} Pipe;
+
+static void* producer(void* p){
+    Pipe* q = (Pipe*)p;
+    for (int i = 0; i < q->count; i++){
+        void* o = q->af(q->sz);
+        if (!o){ fprintf(stderr, "alloc failed\n"); exit(1); }
+        memset(o, 0x3C, q->sz < 64 ? q->sz : 64);
+        size_t t = atomic_load_explicit(&q->tail, memory_order_relaxed);
+        while (t - atomic_load_explicit(&q->head, memory_order_acquire) == RING_CAP) sched_yield();
+        q->slots[t % RING_CAP] = o;
+        atomic_store_explicit(&q->tail, t + 1, memory_order_release);
+    }
+    return NULL;
+}
+
+static void* consumer(void* p){
+    Pipe* q = (Pipe*)p;
+    for (int i = 0; i < q->count; i++){
+        size_t h = atomic_load_explicit(&q->head, memory_order_relaxed);
+        while (atomic_load_explicit(&q->tail, memory_order_acquire) == h) sched_yield();
+        void* o = q->slots[h % RING_CAP];
+        atomic_store_explicit(&q->head, h + 1, memory_order_release);
+        q->ff(o, q->sz);
+    }
+    return NULL;
+}
+
+static void bench_prodcon(const char* name, alloc_fn af, free_fn ff, size_t sz){
+    enum { PAIRS = 4 };
+    int count = 500000;
+    static Pipe pipes[PAIRS];
+    pthread_t th[2 * PAIRS];
+    size_t rss0 = rss_bytes();
+    double t0 = now_ms();
+    for (int i = 0; i < PAIRS; i++){
+        memset(&pipes[i], 0, sizeof(Pipe));
+        pipes[i].af = af; pipes[i].ff = ff; pipes[i].sz = sz; pipes[i].count = count;
+        pthread_create(&th[2 * i], NULL, producer, &pipes[i]);
+        pthread_create(&th[2 * i + 1], NULL, consumer, &pipes[i]);
+    }
+    for (int i = 0; i < 2 * PAIRS; i++) pthread_join(th[i], NULL);
+    double wall = now_ms() - t0;
+    size_t rss1 = rss_bytes();
+    double ops = (double)PAIRS * count / (wall / 1000.0);
+    printf("%s PRODCON size=%zu pairs=%d each=%d wall=%.2fms ops/s=%.0f rss_growth=%.1fMiB\n",
+           name, sz, PAIRS, count, wall, ops, rss1 > rss0 ? (double)(rss1 - rss0) / (1024.0 * 1024.0) : 0.0);
+}
+
+int main(){
+    pageheap_init();
+    bench_prodcon("glibc", sys_alloc, sys_free, 64);
+    bench_prodcon("dmalloc", dm_alloc, dm_free, 64);
+    bench_prodcon("dmalloc-sized", dm_alloc, dm_free_sized, 64);
+    bench_prodcon("glibc", sys_alloc, sys_free, 1024);
+    bench_prodcon("dmalloc", dm_alloc, dm_free, 1024);
+    bench_prodcon("dmalloc-sized", dm_alloc, dm_free_sized, 1024);
+    return 0;
+}
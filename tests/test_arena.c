@@ -0,0 +1,62 @@
+#include "../include/dmalloc.h"
+#include "../include/page_heap.h"
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+int main(){
+    pageheap_init();
+    size_t ps = pageheap_page_size();
+    PageHeapStats s0 = pageheap_stats();
+
+    /* many small objects: aligned, disjoint, contents intact */
+    DmallocArena* a = dmalloc_arena_create();
+    assert(a);
+    enum { N = 20000 };
+    static unsigned char* objs[N];
+    for (int i = 0; i < N; i++){
+        size_t sz = 1 + i % 100;
+        objs[i] = dmalloc_arena_alloc(a, sz);
+        assert(objs[i] && ((uintptr_t)objs[i] % D_ALIGN) == 0);
+        memset(objs[i], i & 0xFF, sz);
+    }
+    for (int i = 0; i < N; i++){
+        size_t sz = 1 + i % 100;
+        assert(objs[i][0] == (i & 0xFF) && objs[i][sz - 1] == (i & 0xFF));
+    }
+    /* zero bytes still gets a distinct pointer; big objects get their own span */
+    void* z0 = dmalloc_arena_alloc(a, 0);
+    void* z1 = dmalloc_arena_alloc(a, 0);
+    assert(z0 && z1 && z0 != z1);
+    unsigned char* big = dmalloc_arena_alloc(a, 300 * ps);
+    assert(big);
+    memset(big, 0x5A, 300 * ps);
+    unsigned char* after = dmalloc_arena_alloc(a, 64);
+    assert(after && (after < big || after >= big + 300 * ps));
+    assert(dmalloc_arena_alloc(a, SIZE_MAX) == NULL);
+    PageHeapStats s1 = pageheap_stats();
+    assert(s1.spans_in_use > s0.spans_in_use);
+
+    /* destroy hands every span back */
+    dmalloc_arena_destroy(a);
+    PageHeapStats s2 = pageheap_stats();
+    assert(s2.spans_in_use == s0.spans_in_use);
+
+    /* arenas are independent */
+    DmallocArena* b = dmalloc_arena_create();
+    DmallocArena* c = dmalloc_arena_create();
+    assert(b && c);
+    int* pb = dmalloc_arena_alloc(b, sizeof(int));
+    int* pc = dmalloc_arena_alloc(c, sizeof(int));
+    *pb = 1;
+    *pc = 2;
+    dmalloc_arena_destroy(c);
+    assert(*pb == 1);
+    dmalloc_arena_destroy(b);
+    dmalloc_arena_destroy(NULL);
+    assert(pageheap_stats().spans_in_use == s0.spans_in_use);
+
+    printf("test_arena OK\n");
+    return 0;
+}
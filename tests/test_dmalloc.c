@@ -1,8 +1,28 @@
 #include "../include/dmalloc.h"
 #include "../include/page_heap.h"
 #include <assert.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#ifdef DMALLOC_DEBUG
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/* dfree_sized with a size that does not match the allocation must abort */
+static void expect_size_abort(size_t alloc, size_t freed){
+    pid_t pid = fork();
+    assert(pid >= 0);
+    if (!pid){
+        void* m = dmalloc(alloc);
+        dfree_sized(m, freed);
+        _exit(0);
+    }
+    int st;
+    assert(waitpid(pid, &st, 0) == pid);
+    assert(WIFSIGNALED(st) && WTERMSIG(st) == SIGABRT);
+}
+#endif
 
 int main(){
     pageheap_init();
@@ -25,13 +45,136 @@ int main(){
     /* free all */
     for (int i = 0; i < N; i++) dfree(ptrs[i]);
 
-    /* large alloc path */
+    /* multi-page size class */
     size_t big = pageheap_page_size() * 3 + 123;
     void* L = dmalloc(big);
     assert(L);
     memset(L, 0xCD, big);
     dfree(L);
 
+    /* beyond the largest size class */
+    size_t huge = MAX_SMALL + 1;
+    void* H = dmalloc(huge);
+    assert(H);
+    memset(H, 0xEF, huge);
+    H = drealloc(H, huge * 2);
+    assert(H);
+    dfree(H);
+
+    /* aligned: naturally aligned classes, aligned spans, aligned mappings */
+    size_t ps = pageheap_page_size();
+    static const size_t aligns[] = { 32, 64, 4096, 65536, 1u << 21 };
+    static const size_t sizes[] = { 1, 64, 3000, 70000, 600000, 3u << 20 };
+    for (size_t i = 0; i < sizeof(aligns) / sizeof(aligns[0]); i++){
+        for (size_t j = 0; j < sizeof(sizes) / sizeof(sizes[0]); j++){
+            void* A = dmalloc_aligned(sizes[j], aligns[i]);
+            assert(A && ((uintptr_t)A & (aligns[i] - 1)) == 0);
+            assert(dmalloc_usable_size(A) >= sizes[j]);
+            memset(A, 0x5A, sizes[j]);
+            dfree(A);
+        }
+    }
+    assert(dmalloc_aligned(64, 48) == NULL);
+    /* a large aligned block costs its own pages only */
+    PageHeapStats st0 = pageheap_stats();
+    void* A = dmalloc_aligned(ps * 40, ps * 64);
+    assert(A && ((uintptr_t)A & (ps * 64 - 1)) == 0);
+    PageHeapStats st1 = pageheap_stats();
+    assert(st0.free_pages + (st1.mapped_pages - st0.mapped_pages) - st1.free_pages == 40);
+    A = drealloc(A, ps * 80);
+    assert(A);
+    dfree(A);
+
+    /* calloc: fresh pages are trusted, reused dirty ones must be cleared */
+    size_t zn = ps * 50;
+    unsigned char* Z = dcalloc(zn, 1);
+    assert(Z);
+    for (size_t i = 0; i < zn; i++) assert(Z[i] == 0);
+    memset(Z, 0xFF, zn);
+    dfree(Z);
+    for (int k = 0; k < 3; k++){
+        Z = dcalloc(1, zn);
+        assert(Z);
+        for (size_t i = 0; i < zn; i++) assert(Z[i] == 0);
+        memset(Z, 0xFF, zn);
+        dfree(Z);
+        pageheap_release_empty_spans(1);
+    }
+    unsigned* S = dcalloc(100, sizeof(unsigned));
+    assert(S);
+    for (int i = 0; i < 100; i++) assert(S[i] == 0);
+    dfree(S);
+    assert(dcalloc(SIZE_MAX / 8, 16) == NULL);
+
+    /* realloc of large objects: shrink stays in place, content survives growth */
+    size_t ln = MAX_SMALL + 10 * ps;
+    unsigned char* R = dmalloc(ln);
+    assert(R);
+    for (size_t i = 0; i < ln; i++) R[i] = (unsigned char)i;
+    assert(drealloc(R, ln - 5 * ps) == R);
+    R = drealloc(R, ln * 3);
+    assert(R);
+    for (size_t i = 0; i < ln - 5 * ps; i++) assert(R[i] == (unsigned char)i);
+    dfree(R);
+    /* direct blocks move with mremap */
+    size_t dn = DMALLOC_DIRECT_THRESHOLD * 2;
+    R = dmalloc(dn);
+    assert(R);
+    for (size_t i = 0; i < dn; i += 512) R[i] = (unsigned char)(i >> 9);
+    R = drealloc(R, dn * 4);
+    assert(R && dmalloc_usable_size(R) >= dn * 4);
+    for (size_t i = 0; i < dn; i += 512) assert(R[i] == (unsigned char)(i >> 9));
+    R = drealloc(R, dn / 2 + 1);
+    assert(R && dmalloc_usable_size(R) < dn);
+    for (size_t i = 0; i < dn / 2; i += 512) assert(R[i] == (unsigned char)(i >> 9));
+    dfree(R);
+
+    /* batches: distinct usable objects, freed together in any mix */
+    enum { BN = 1000 };
+    static void* B[BN];
+    size_t bsizes[] = {24, 200, MAX_SMALL + 1};
+    for (int k = 0; k < 3; k++){
+        assert(dmalloc_batch(bsizes[k], B, BN) == BN);
+        for (int i = 0; i < BN; i++){
+            assert(B[i] && dmalloc_usable_size(B[i]) >= bsizes[k]);
+            memset(B[i], k + 1, bsizes[k]);
+        }
+        for (int i = 0; i < BN; i++){
+            assert(((unsigned char*)B[i])[bsizes[k] - 1] == k + 1);
+            for (int j = i + 1; j < BN && j < i + 64; j++) assert(B[i] != B[j]);
+        }
+        if (k < 2) dfree_batch(B, BN);
+        else { dfree_batch(B, BN / 2); for (int i = BN / 2; i < BN; i++) dfree(B[i]); }
+    }
+    for (int i = 0; i < BN; i++) B[i] = (i & 3) ? dmalloc(16 + i % 500) : NULL;
+    dfree_batch(B, BN);
+    /* a freed batch is handed out again */
+    assert(dmalloc_batch(64, B, BN) == BN);
+    dfree_batch(B, BN);
+    assert(dmalloc_batch(64, B, BN) == BN);
+    dfree_batch(B, BN);
+
+    /* sized frees land in the cache the class maps to */
+    size_t fs[] = {0, 1, 100, 1000, 5000, MAX_SMALL};
+    for (int i = 0; i < 6; i++){
+        void* P = dmalloc(fs[i]);
+        assert(P);
+        dfree_sized(P, fs[i]);
+        assert(dmalloc(fs[i]) == P);
+        dfree_sized(P, fs[i]);
+    }
+    void* Q = dcalloc(10, 30);
+    Q = drealloc(Q, 290);
+    dfree_sized(Q, 290);
+    dfree_sized(dmalloc(MAX_SMALL + 1), MAX_SMALL + 1);
+    dfree_sized(dmalloc(DMALLOC_DIRECT_THRESHOLD * 2), DMALLOC_DIRECT_THRESHOLD * 2);
+    dfree_sized(NULL, 8);
+#ifdef DMALLOC_DEBUG
+    expect_size_abort(100, 300);
+    expect_size_abort(MAX_SMALL + 1, 4 * MAX_SMALL);
+    expect_size_abort(MAX_SMALL + 1, 64);
+#endif
+
     printf("test_dmalloc OK\n");
     return 0;
 }
@@ -1,15 +1,39 @@
 #include "../include/dmalloc.h"
 #include "../include/page_heap.h"
 #include <assert.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
+
+#ifndef PERCPU_SUPPORTED
+/* a burst that overflows the thread cache: whole batches land in the
+ * transfer cache, the rest goes back to central when the thread exits */
+static void* flush_burst(void* arg){
+    enum { N = 20000 };
+    static void* objs[N];
+    (void)arg;
+    for (int i = 0; i < N; i++){
+        objs[i] = dmalloc(2048);
+        assert(objs[i]);
+        memset(objs[i], 0xDD, 2048);
+    }
+    for (int i = 0; i < N; i++) dfree(objs[i]);
+    return NULL;
+}
+
+static void run_burst(void){
+    pthread_t t;
+    assert(pthread_create(&t, NULL, flush_burst, NULL) == 0);
+    pthread_join(t, NULL);
+}
+#endif
 
 int main(){
     pageheap_init();
     PageHeapStats s0 = pageheap_stats();
 
-    size_t ps = pageheap_page_size();
-    size_t big = ps * 8 + 123; /* large object spanning multiple pages */
+    size_t big = DMALLOC_DIRECT_THRESHOLD + 123; /* huge: direct mapping */
     void* p = dmalloc(big);
     assert(p);
     memset(p, 0xAA, big);
@@ -33,6 +57,68 @@ int main(){
     assert(s3.mapped_pages == s2.mapped_pages);
     assert(s3.free_pages == s2.free_pages);
 
+    /* large object below the direct threshold comes from the page heap */
+    size_t mid = MAX_SMALL + 123;
+    void* q = dmalloc(mid);
+    assert(q);
+    memset(q, 0xBB, mid);
+    PageHeapStats s4 = pageheap_stats();
+    assert(s4.spans_in_use == s3.spans_in_use + 1);
+    assert(s4.mapped_pages > s3.mapped_pages);
+
+    dfree(q);
+    PageHeapStats s5 = pageheap_stats();
+    assert(s5.spans_in_use == s3.spans_in_use);
+    assert(s5.free_pages == s5.mapped_pages);
+    released = pageheap_release_empty_spans(1);
+    assert(released == s5.mapped_pages);
+    assert(pageheap_stats().mapped_pages == 0);
+
+    /* a burst of small objects hands its spans back to the page heap once freed */
+    enum { BURST = 20000 };
+    static void* objs[BURST];
+    PageHeapStats b0 = pageheap_stats();
+    for (int i = 0; i < BURST; i++){
+        objs[i] = dmalloc(1024);
+        assert(objs[i]);
+        memset(objs[i], 0xCC, 1024);
+    }
+    PageHeapStats b1 = pageheap_stats();
+    assert(b1.spans_in_use > b0.spans_in_use + 100);
+    for (int i = 0; i < BURST; i++) dfree(objs[i]);
+    PageHeapStats b2 = pageheap_stats();
+    assert(b2.spans_in_use <= b0.spans_in_use + 8);
+    assert(pageheap_release_empty_spans(1) > 0);
+
+#ifndef PERCPU_SUPPORTED
+    /* per-CPU slabs overflow straight to central; this is the thread cache path */
+    /* parked batches pin their spans until the scavenger finds them idle;
+     * central itself keeps up to two spans' worth of free slots */
+    PageHeapStats t0 = pageheap_stats();
+    run_burst();
+    size_t pinned = pageheap_stats().spans_in_use;
+    assert(dmalloc_transfer_bytes() > 0);
+    assert(pinned > t0.spans_in_use + 2);
+    assert(dmalloc_scavenger_start((size_t)1 << 30) == 0);
+    for (int i = 0; i < 100 && dmalloc_transfer_bytes(); i++){
+        struct timespec ts = { 0, 50 * 1000000L };
+        nanosleep(&ts, NULL);
+    }
+    dmalloc_scavenger_stop();
+    assert(dmalloc_transfer_bytes() == 0);
+    assert(pageheap_stats().spans_in_use <= t0.spans_in_use + 2);
+
+    /* and right away on an explicit trim */
+    run_burst();
+    assert(dmalloc_transfer_bytes() > 0);
+    assert(dmalloc_trim() > 0);
+    assert(dmalloc_transfer_bytes() == 0);
+    assert(pageheap_stats().spans_in_use <= t0.spans_in_use + 2);
+#ifndef DMALLOC_HUGEPAGE
+    assert(pageheap_stats().free_pages == 0);
+#endif
+#endif
+
     printf("test_free_release OK\n");
     return 0;
 }
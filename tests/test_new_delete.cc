@@ -0,0 +1,88 @@
+#include <cassert>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <dlfcn.h>
+#include <new>
+
+/* plain C++ program; run with LD_PRELOAD=build/libdmalloc.so */
+
+struct alignas(64) Line { char b[100]; };
+struct alignas(4096) Page { char b[5000]; };
+struct Node { Node* next; long v[5]; };
+
+static bool aligned(const void* p, std::size_t a){ return ((std::uintptr_t)p & (a - 1)) == 0; }
+
+int main(){
+    /* the operators must come from the preloaded library */
+    Dl_info info;
+    void* (*op_new)(std::size_t) = &::operator new;
+    assert(dladdr((void*)op_new, &info) && std::strstr(info.dli_fname, "libdmalloc"));
+
+    /* plain and array forms */
+    Node* n = new Node();
+    assert(n && aligned(n, 16) && n->next == nullptr);
+    delete n;
+    int* a = new int[1000]();
+    for (int i = 0; i < 1000; i++) assert(a[i] == 0);
+    delete[] a;
+
+    /* sized delete frees into the class the size maps to: the next
+     * allocation of that size gets the same block back */
+    std::size_t sizes[] = { 1, 24, 100, 1000, 5000, 300000 };
+    for (std::size_t s : sizes){
+        void* p = ::operator new(s);
+        std::memset(p, 1, s);
+        ::operator delete(p, s);
+        void* q = ::operator new(s);
+        assert(q == p);
+        ::operator delete(q, s);
+        char* arr = new char[s];
+        ::operator delete[](arr, s);
+    }
+    /* the compiler's own sized deletes, with a non-trivial destructor cookie */
+    struct Tracked { long v[3]; ~Tracked(){ v[0] = 0; } };
+    Tracked* t = new Tracked[37];
+    delete[] t;
+    for (int i = 0; i < 1000; i++) delete new Node();
+
+    /* over-aligned types and explicit aligned forms */
+    Line* l = new Line();
+    assert(aligned(l, 64));
+    delete l;
+    Line* ls = new Line[10];
+    assert(aligned(ls, 64));
+    delete[] ls;
+    Page* pg = new Page();
+    assert(aligned(pg, 4096));
+    std::memset(pg->b, 2, sizeof(pg->b));
+    delete pg;
+    void* al = ::operator new(3000, std::align_val_t(4096));
+    assert(aligned(al, 4096));
+    ::operator delete(al, 3000, std::align_val_t(4096));
+    al = ::operator new[](64, std::align_val_t(256));
+    assert(aligned(al, 256));
+    ::operator delete[](al, std::align_val_t(256));
+
+    /* nothrow forms, and failure reporting */
+    int* nt = new (std::nothrow) int[10];
+    assert(nt);
+    delete[] nt;
+    Line* nl = new (std::nothrow) Line();
+    assert(nl && aligned(nl, 64));
+    delete nl;
+    volatile std::size_t huge = SIZE_MAX / 4;
+    assert(::operator new(huge, std::nothrow) == nullptr);
+    assert(::operator new[](huge, std::align_val_t(64), std::nothrow) == nullptr);
+    bool threw = false;
+    try {
+        void* p = ::operator new(huge);
+        ::operator delete(p);
+    } catch (const std::bad_alloc&) {
+        threw = true;
+    }
+    assert(threw);
+
+    std::printf("TEST_NEW_DELETE_OK\n");
+    return 0;
+}
@@ -1,7 +1,18 @@
 #include "../include/page_heap.h"
 #include <assert.h>
+#include <stdint.h>
 #include <stdio.h>
 
+/* growth commits whole hugepages in the hugepage-aware mode */
+static size_t grown(size_t pages){
+#ifdef DMALLOC_HUGEPAGE
+    size_t hp = HUGEPAGE_SIZE / pageheap_page_size();
+    return (pages + hp - 1) / hp * hp;
+#else
+    return pages;
+#endif
+}
+
 int main() {
     pageheap_init();
     PageHeapStats st = pageheap_stats();
@@ -11,9 +22,15 @@ int main() {
     // grow a free span of 64 pages
     assert(pageheap_grow(64) == 0);
     st = pageheap_stats();
-    assert(st.mapped_pages == 64);
-    assert(st.free_pages == 64);
+    assert(st.mapped_pages == grown(64));
+    assert(st.free_pages == grown(64));
     assert(st.spans_free == 1);
+    // span records fit a cache line with the free list links inline, and save
+    // the difference to the skiplist record for every record carved
+    assert(sizeof(Span) <= 64);
+    assert(st.meta_bytes > 0);
+    assert(sizeof(SkiplistSpan) > sizeof(Span));
+    assert(st.meta_bytes_saved == st.meta_bytes / sizeof(Span) * (sizeof(SkiplistSpan) - sizeof(Span)));
 
     // allocate and free several spans to exercise split and coalesce
     Span* a = span_alloc(10);
@@ -29,13 +46,13 @@ int main() {
     st = pageheap_stats();
     // After freeing and coalescing, expect one free span of 64 pages
     assert(st.spans_in_use == 0);
-    assert(st.free_pages == 64);
+    assert(st.free_pages == grown(64));
     assert(st.spans_free == 1);
 
     // hard release: free spans >= 64 pages should be munmap'ed
     size_t released = pageheap_release_empty_spans(64);
     st = pageheap_stats();
-    assert(released == 64);
+    assert(released == grown(64));
     assert(st.mapped_pages == 0);
     assert(st.free_pages == 0);
     assert(st.spans_free == 0);
@@ -43,14 +60,99 @@ int main() {
     // grow again and soft reclaim
     assert(pageheap_grow(32) == 0);
     st = pageheap_stats();
-    assert(st.free_pages == 32);
+    assert(st.free_pages == grown(32));
     size_t advised = pageheap_madvise_idle_spans(16);
-    assert(advised == 32);
+    assert(advised == grown(32));
+    // spans already advised are not advised again
+    assert(pageheap_madvise_idle_spans(16) == 0);
+    assert(pageheap_stats().released_pages == grown(32));
     // madvise does not change stats
     PageHeapStats st2 = pageheap_stats();
-    assert(st2.free_pages == 32);
+    assert(st2.free_pages == grown(32));
     assert(st2.mapped_pages == st.mapped_pages);
 
+    // growth is carved from one reserved range: consecutive growths are
+    // contiguous and coalesce with each other once freed
+    Span* g1 = span_alloc(64);
+    Span* g2 = span_alloc(64);
+    assert(g1 && g2);
+    assert((char*)span_ptr(g2) == (char*)span_ptr(g1) + 64 * st.page_size);
+    span_free(g1);
+    span_free(g2);
+    st = pageheap_stats();
+    assert(st.spans_free == 1);
+    assert(st.free_pages == st.mapped_pages);
+    // released ranges are decommitted but reused by the next growth
+    void* old = span_ptr(g1);
+    assert(pageheap_release_empty_spans(1) == st.mapped_pages);
+    assert(pageheap_stats().mapped_pages == 0);
+    Span* g3 = span_alloc(64);
+    assert(g3);
+    assert((char*)span_ptr(g3) <= (char*)old);
+    ((char*)span_ptr(g3))[0] = 1;
+    span_free(g3);
+
+    // aligned spans: the pages in front of the boundary stay free and merge back
+    Span* pad = span_alloc(1);
+    Span* al = span_alloc_aligned(3, 16);
+    assert(pad && al);
+    assert(((uintptr_t)span_ptr(al) & (16 * st.page_size - 1)) == 0);
+    assert(span_page_count(al) == 3);
+    st = pageheap_stats();
+    assert(st.spans_in_use == 2);
+    assert(st.mapped_pages - st.free_pages == 4);
+    span_free(al);
+    span_free(pad);
+    st = pageheap_stats();
+    assert(st.spans_free == 1 && st.free_pages == st.mapped_pages);
+    assert(span_alloc_aligned(1, 3) == NULL);
+
+    // zero state: fresh and madvised pages are zeroed, freed ones are dirty
+    pageheap_release_empty_spans(1);
+    Span* z1 = span_alloc(40);
+    assert(z1 && z1->zeroed);
+    span_free(z1);
+    Span* z2 = span_alloc(40);
+    assert(z2 && !z2->zeroed);
+    span_free(z2);
+    pageheap_madvise_idle_spans(1);
+    Span* z3 = span_alloc(40);
+    assert(z3 && z3->zeroed);
+    span_free(z3);
+
+    // in-place resize: extend into the free span behind, shrink frees the tail
+    Span* x = span_alloc(8);
+    Span* y = span_alloc(8);
+    assert(x && y);
+    span_free(y);
+    assert(span_extend(x, 12) == 0);
+    assert(span_page_count(x) == 12);
+    assert(pageheap_span_of((char*)span_ptr(x) + 11 * st.page_size) == x);
+    Span* w = span_alloc(1);
+    assert(w && (char*)span_ptr(w) == (char*)span_ptr(x) + 12 * st.page_size);
+    assert(span_extend(x, 13) == -1);
+    assert(span_shrink(x, 3) == 0);
+    assert(span_page_count(x) == 3);
+    Span* v = span_alloc(9);
+    assert(v && (char*)span_ptr(v) == (char*)span_ptr(x) + 3 * st.page_size);
+    span_free(v);
+    span_free(w);
+    span_free(x);
+    st = pageheap_stats();
+    assert(st.spans_in_use == 0 && st.spans_free == 1);
+
+    // only pages that were really advised count as released
+    pageheap_release_empty_spans(1);
+    Span* one = span_alloc(1);
+    assert(one);
+    size_t r0 = pageheap_stats().released_pages;
+    advised = pageheap_madvise_idle_spans(1);
+    assert(pageheap_stats().released_pages - r0 == advised);
+#ifdef DMALLOC_HUGEPAGE
+    assert(advised % (HUGEPAGE_SIZE / st.page_size) == 0);
+#endif
+    span_free(one);
+
     printf("test_page_heap OK\n");
     return 0;
 }
@@ -0,0 +1,71 @@
+#include "../include/dmalloc.h"
+#include "../include/page_heap.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+int main(){
+    pageheap_init();
+    /* a burst of medium objects hands its spans back to the page heap once freed */
+    enum { N = 4000, SZ = 32768 };
+    static void* objs[N];
+    for (int i = 0; i < N; i++){
+        objs[i] = dmalloc(SZ);
+        assert(objs[i]);
+        memset(objs[i], 0xAB, SZ);
+    }
+    for (int i = 0; i < N; i++) dfree(objs[i]);
+    PageHeapStats s0 = pageheap_stats();
+    assert(s0.free_pages > 0);
+    assert(s0.released_pages == 0);
+
+    /* two pages a second: credit builds up over ticks until a page is due */
+    size_t ps = pageheap_page_size();
+    assert(dmalloc_scavenger_start(2 * ps) == 0);
+    PageHeapStats slow = s0;
+    for (int i = 0; i < 60 && !slow.released_pages; i++){
+        struct timespec ts = { 0, 50 * 1000000L };
+        nanosleep(&ts, NULL);
+        slow = pageheap_stats();
+    }
+    assert(slow.released_pages > 0);
+
+    /* spans must stay idle for a whole interval, then go back at the given rate */
+    assert(dmalloc_scavenger_start((size_t)1 << 30) == 0);
+    PageHeapStats s1 = s0;
+#ifdef DMALLOC_HUGEPAGE
+    /* ragged ends in partly used hugepages stay: wait until it settles */
+    for (int i = 0, still = 0; i < 100 && still < 3; i++){
+        struct timespec ts = { 0, 50 * 1000000L };
+        nanosleep(&ts, NULL);
+        size_t before = s1.released_pages;
+        s1 = pageheap_stats();
+        still = s1.released_pages && s1.released_pages == before ? still + 1 : 0;
+    }
+    assert(s1.released_pages > 0);
+#else
+    for (int i = 0; i < 100 && s1.released_pages < s1.free_pages; i++){
+        struct timespec ts = { 0, 50 * 1000000L };
+        nanosleep(&ts, NULL);
+        s1 = pageheap_stats();
+    }
+    assert(s1.released_pages == s1.free_pages);
+#endif
+    /* nothing is advised twice */
+    assert(pageheap_madvise_idle_spans(1) == 0);
+    dmalloc_scavenger_stop();
+
+    /* released memory is reused normally */
+    for (int i = 0; i < N; i++){
+        objs[i] = dmalloc(SZ);
+        assert(objs[i]);
+        memset(objs[i], 0xCD, SZ);
+    }
+    PageHeapStats s2 = pageheap_stats();
+    assert(s2.released_pages < s1.released_pages);
+    for (int i = 0; i < N; i++) dfree(objs[i]);
+
+    printf("test_scavenger OK\n");
+    return 0;
+}
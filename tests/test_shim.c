@@ -0,0 +1,113 @@
+#define _GNU_SOURCE
+#include <assert.h>
+#include <dlfcn.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/* plain libc program; run with LD_PRELOAD=build/libdmalloc.so */
+
+static int aligned(void* p, size_t a){ return ((uintptr_t)p & (a - 1)) == 0; }
+
+static volatile int churn_stop;
+static void* churn(void* arg){
+    (void)arg;
+    while (!churn_stop){
+        /* page heap spans and central batches, so locks are held often */
+        void* a[64];
+        for (int i = 0; i < 64; i++) a[i] = malloc(i & 1 ? 300000 : 4096);
+        for (int i = 0; i < 64; i++) free(a[i]);
+    }
+    return NULL;
+}
+
+int main(){
+    /* the preloaded library must be the one serving malloc */
+    assert(dlsym(RTLD_DEFAULT, "dmalloc") != NULL);
+
+    char* p = malloc(100);
+    assert(p && aligned(p, 16));
+    memset(p, 0x5a, 100);
+    assert(malloc_usable_size(p) >= 100);
+    p = realloc(p, 100000);
+    assert(p);
+    for (int i = 0; i < 100; i++) assert(p[i] == 0x5a);
+    assert(malloc_usable_size(p) >= 100000);
+    free(p);
+
+    unsigned* z = calloc(1000, sizeof(unsigned));
+    assert(z);
+    for (int i = 0; i < 1000; i++) assert(z[i] == 0);
+    free(z);
+    volatile size_t huge = SIZE_MAX / 2;
+    assert(calloc(huge, 4) == NULL);
+
+    static const size_t aligns[] = { 32, 64, 256, 4096, 65536, 1u << 21 };
+    static const size_t sizes[] = { 1, 48, 1000, 5000, 300000, 3u << 20 };
+    for (size_t i = 0; i < sizeof(aligns) / sizeof(aligns[0]); i++){
+        for (size_t j = 0; j < sizeof(sizes) / sizeof(sizes[0]); j++){
+            void* q = NULL;
+            assert(posix_memalign(&q, aligns[i], sizes[j]) == 0);
+            assert(aligned(q, aligns[i]));
+            assert(malloc_usable_size(q) >= sizes[j]);
+            memset(q, 0x11, sizes[j]);
+            void* r = aligned_alloc(aligns[i], sizes[j]);
+            assert(r && aligned(r, aligns[i]));
+            memset(r, 0x22, sizes[j]);
+            free(q);
+            free(r);
+        }
+    }
+    void* q;
+    assert(posix_memalign(&q, 24, 8) != 0);
+    void* v = valloc(10);
+    assert(v && aligned(v, 4096));
+    free(v);
+
+    /* stdio buffers and strdup come from the shim too */
+    char* s = strdup("dmalloc");
+    assert(s && strcmp(s, "dmalloc") == 0);
+    free(s);
+    /* fork while other threads and the scavenger are inside the allocator:
+     * the child must not inherit a held lock */
+    int (*scav_start)(size_t) = (int (*)(size_t))dlsym(RTLD_DEFAULT, "dmalloc_scavenger_start");
+    void (*scav_stop)(void) = (void (*)(void))dlsym(RTLD_DEFAULT, "dmalloc_scavenger_stop");
+    assert(scav_start && scav_stop && scav_start((size_t)1 << 30) == 0);
+    pthread_t th[4];
+    for (int i = 0; i < 4; i++) assert(pthread_create(&th[i], NULL, churn, NULL) == 0);
+    for (int i = 0; i < 100; i++){
+        usleep(1000);
+        pid_t pid = fork();
+        assert(pid >= 0);
+        if (!pid){
+            alarm(10);
+            for (int k = 0; k < 100; k++){
+                char* c = malloc(16 + k * 100);
+                memset(c, 1, 16 + k * 100);
+                free(c);
+            }
+            /* more than the thread caches hold: central and the page heap */
+            static void* keep[256];
+            for (int k = 0; k < 256; k++) keep[k] = malloc(k & 1 ? 300000 : 4096);
+            for (int k = 0; k < 256; k++) free(keep[k]);
+            free(malloc(1u << 20));
+            /* the child starts without a scavenger and can run its own */
+            assert(scav_start(1u << 20) == 0);
+            scav_stop();
+            _exit(0);
+        }
+        int st;
+        assert(waitpid(pid, &st, 0) == pid && WIFEXITED(st) && WEXITSTATUS(st) == 0);
+    }
+    churn_stop = 1;
+    for (int i = 0; i < 4; i++) pthread_join(th[i], NULL);
+    scav_stop();
+
+    printf("TEST_SHIM_OK\n");
+    return 0;
+}
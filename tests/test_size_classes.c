@@ -0,0 +1,53 @@
+#include "../include/size_classes.h"
+#include <assert.h>
+#include <stdio.h>
+
+int main(){
+    // classes are 16-byte aligned, strictly increasing and end at SIZE_CLASS_MAX
+    for (int i = 0; i < SIZE_CLASS_COUNT; i++){
+        assert(size_class_info[i].size % 16 == 0);
+        assert(size_class_info[i].batch >= 2);
+        if (i) assert(size_class_info[i].size > size_class_info[i - 1].size);
+        // spacing stays within 12.5% past the linear range
+        if (i && size_class_info[i - 1].size >= 128)
+            assert(size_class_info[i].size - size_class_info[i - 1].size <= size_class_info[i - 1].size / 8);
+        // a span holds at least one batch and wastes at most 1/8 of itself
+        size_t bytes = (size_t)size_class_info[i].pages * SIZE_CLASS_PAGE;
+        assert(bytes / size_class_info[i].size >= size_class_info[i].batch);
+        assert(bytes % size_class_info[i].size <= bytes / 8);
+        // ... and is the smallest span that does
+        for (size_t p = 1; p < size_class_info[i].pages; p++){
+            size_t b = p * SIZE_CLASS_PAGE;
+            assert(b / size_class_info[i].size < size_class_info[i].batch ||
+                   b % size_class_info[i].size > b / 8);
+        }
+        // batch = clamp(128 KiB / size, 2, 512)
+        size_t want = (128 << 10) / size_class_info[i].size;
+        if (want < 2) want = 2;
+        if (want > 512) want = 512;
+        assert(size_class_info[i].batch == want);
+    }
+    assert(size_class_info[SIZE_CLASS_COUNT - 1].size == SIZE_CLASS_MAX);
+
+    // lookup yields the smallest class that fits every size
+    for (size_t sz = 0; sz <= SIZE_CLASS_MAX; sz++){
+        size_t idx = size_class_lookup_index(sz);
+        assert(idx < SIZE_CLASS_LOOKUP_LEN);
+        int sc = size_class_lookup[idx];
+        assert(size_class_info[sc].size >= sz);
+        if (sc) assert(size_class_info[sc - 1].size < (sz ? sz : 1));
+    }
+
+    // every lookup bucket holds the smallest class fitting the largest size it covers
+    for (size_t idx = 0; idx < SIZE_CLASS_LOOKUP_LEN; idx++){
+        size_t top = idx <= 128 ? idx * 8 : idx * 128 - (120 << 7);
+        assert(size_class_lookup_index(top) == idx);
+        assert(idx + 1 == SIZE_CLASS_LOOKUP_LEN || size_class_lookup_index(top + 1) == idx + 1);
+        int sc = size_class_lookup[idx];
+        assert(size_class_info[sc].size >= top);
+        if (sc) assert(size_class_info[sc - 1].size < top);
+    }
+
+    printf("test_size_classes OK\n");
+    return 0;
+}
@@ -0,0 +1,105 @@
+#include "../include/dmalloc.h"
+#include "../include/page_heap.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+/* built with a 1 MiB DMALLOC_TCACHE_BUDGET (see Makefile) */
+
+enum { BURST = 4096 };
+
+/* allocate and free bursts of one size so its list keeps missing */
+static void churn(size_t sz, int rounds)
+{
+    static __thread void* objs[BURST];
+    for (int r = 0; r < rounds; r++){
+        for (int i = 0; i < BURST; i++){
+            objs[i] = dmalloc(sz);
+            assert(objs[i]);
+        }
+        for (int i = 0; i < BURST; i++) dfree(objs[i]);
+    }
+}
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static int phase;
+static size_t hog_bytes;
+
+static void wait_phase(int p)
+{
+    pthread_mutex_lock(&lock);
+    while (phase < p) pthread_cond_wait(&cond, &lock);
+    pthread_mutex_unlock(&lock);
+}
+
+static void set_phase(int p)
+{
+    pthread_mutex_lock(&lock);
+    phase = p;
+    pthread_cond_broadcast(&cond);
+    pthread_mutex_unlock(&lock);
+}
+
+/* claims the whole budget, then sits idle until the busy thread is done */
+static void* hog(void* arg)
+{
+    (void)arg;
+    for (size_t sz = 64; sz <= 2048; sz *= 2) churn(sz, 3);
+    dmalloc_tcache_stats(&hog_bytes, NULL);
+    set_phase(1);
+    wait_phase(2);
+    /* the next slow path pays what the busy thread took */
+    churn(8192, 1);
+    size_t after;
+    dmalloc_tcache_stats(&after, NULL);
+    assert(after < hog_bytes);
+    return NULL;
+}
+
+static void* busy(void* arg)
+{
+    (void)arg;
+    churn(512, 20);
+    size_t mine, total;
+    dmalloc_tcache_stats(&mine, &total);
+    /* grew although the budget was spent when it started */
+    assert(mine >= 2 * 512 * size_class_info[size_class_lookup[size_class_lookup_index(512)]].batch);
+    return NULL;
+}
+
+int main(){
+    pageheap_init();
+#ifdef PERCPU_SUPPORTED
+    /* small objects live in per-CPU slabs; thread lists stay unused */
+    printf("test_tcache OK\n");
+    return 0;
+#endif
+    /* lists start empty and grow with use, within the budget */
+    size_t mine, total;
+    dmalloc_tcache_stats(&mine, &total);
+    assert(mine == 0 && total == 0);
+    churn(1024, 4);
+    dmalloc_tcache_stats(&mine, &total);
+    assert(mine > 0 && mine <= DMALLOC_TCACHE_BUDGET);
+    assert(total == mine);
+
+    pthread_t h, b;
+    pthread_create(&h, NULL, hog, NULL);
+    wait_phase(1);
+    dmalloc_tcache_stats(NULL, &total);
+    assert(total + 64 * 1024 > DMALLOC_TCACHE_BUDGET);
+    pthread_create(&b, NULL, busy, NULL);
+    pthread_join(b, NULL);
+    set_phase(2);
+    pthread_join(h, NULL);
+
+    /* exited threads hand their capacity back; main may have been stolen
+     * from too and pays on its next miss */
+    churn(1024, 1);
+    dmalloc_tcache_stats(&mine, &total);
+    assert(total == mine);
+    printf("test_tcache OK\n");
+    return 0;
+}
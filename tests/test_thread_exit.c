@@ -0,0 +1,42 @@
+#include "../include/dmalloc.h"
+#include "../include/page_heap.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+static void* worker(void* arg)
+{
+    (void)arg;
+    enum { N = 1000 };
+    void* ptrs[N];
+    for (int i = 0; i < N; i++){
+        ptrs[i] = dmalloc(1024);
+        assert(ptrs[i]);
+        memset(ptrs[i], 0x11, 1024);
+    }
+    for (int i = 0; i < N; i++) dfree(ptrs[i]);
+    /* lands in this thread's large bucket cache on free */
+    size_t big = pageheap_page_size() * 96 - 64;
+    void* L = dmalloc(big);
+    assert(L);
+    memset(L, 0x22, big);
+    dfree(L);
+    return NULL;
+}
+
+int main(){
+    pageheap_init();
+    // short-lived threads one after another: each exit must flush its cache
+    for (int i = 0; i < 200; i++){
+        pthread_t th;
+        pthread_create(&th, NULL, worker, NULL);
+        pthread_join(th, NULL);
+    }
+    PageHeapStats st = pageheap_stats();
+    // recycled caches share one shard, which keeps at most a couple of spans
+    assert(st.spans_in_use <= 4);
+
+    printf("test_thread_exit OK\n");
+    return 0;
+}
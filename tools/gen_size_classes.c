@@ -0,0 +1,72 @@
+#include "../include/size_classes.h"
+#include <stdio.h>
+
+/* writes src/size_classes.c (make size-classes). The rules live here; the
+ * header only fixes the counts, and a mismatch fails the generator */
+
+static uint32_t sizes[SIZE_CLASS_COUNT];
+
+static int build_sizes(void)
+{
+    int n = 0;
+    for (uint32_t s = 16; s <= 128; s += 16) sizes[n++] = s;
+    for (uint32_t base = 128; base < SIZE_CLASS_MAX; base *= 2)
+        for (uint32_t s = base + base / 8; s <= 2 * base; s += base / 8){
+            if (n == SIZE_CLASS_COUNT) return -1;
+            sizes[n++] = s;
+        }
+    return n;
+}
+
+static unsigned batch_for(uint32_t size)
+{
+    uint32_t b = (128 << 10) / size;
+    return b < 2 ? 2 : b > 512 ? 512 : b;
+}
+
+/* smallest span holding at least one batch with <= 1/8 tail waste */
+static unsigned pages_for(uint32_t size, unsigned batch)
+{
+    for (unsigned p = 1; ; p++){
+        size_t bytes = (size_t)p * SIZE_CLASS_PAGE;
+        if (bytes / size >= batch && bytes % size <= bytes / 8) return p;
+    }
+}
+
+/* largest size that maps to lookup bucket idx */
+static size_t bucket_max(size_t idx)
+{
+    return idx <= 128 ? idx * 8 : idx * 128 - (120 << 7);
+}
+
+int main(void)
+{
+    if (build_sizes() != SIZE_CLASS_COUNT || sizes[SIZE_CLASS_COUNT - 1] != SIZE_CLASS_MAX ||
+        size_class_lookup_index(SIZE_CLASS_MAX) != SIZE_CLASS_LOOKUP_LEN - 1){
+        fprintf(stderr, "gen_size_classes: rules disagree with include/size_classes.h\n");
+        return 1;
+    }
+    printf("#include \"../include/size_classes.h\"\n\n");
+    printf("/* generated by tools/gen_size_classes.c (make size-classes); do not edit.\n"
+           " * Classes step by 16 bytes up to 128, then eight classes per power of two\n"
+           " * (12.5%% spacing) up to 256 KiB. pages is the smallest span (in\n"
+           " * SIZE_CLASS_PAGE units) holding at least one batch with <= 1/8 tail\n"
+           " * waste; batch = clamp(128 KiB / size, 2, 512) objects per transfer.\n"
+           " */\n");
+    printf("const SizeClassInfo size_class_info[SIZE_CLASS_COUNT] = {\n");
+    for (int i = 0; i < SIZE_CLASS_COUNT; i++){
+        unsigned batch = batch_for(sizes[i]);
+        printf("    { %6u, %3u, %3u }, /* %2d */\n", sizes[i], pages_for(sizes[i], batch), batch, i);
+    }
+    printf("};\n\n");
+    printf("/* class index for each size_class_lookup_index() bucket */\n");
+    printf("const uint8_t size_class_lookup[SIZE_CLASS_LOOKUP_LEN] = {\n");
+    int sc = 0;
+    for (size_t idx = 0; idx < SIZE_CLASS_LOOKUP_LEN; idx++){
+        while (sizes[sc] < bucket_max(idx)) sc++;
+        printf("%s%2d,%s", idx % 16 ? " " : "    ", sc,
+               idx % 16 == 15 || idx + 1 == SIZE_CLASS_LOOKUP_LEN ? "\n" : "");
+    }
+    printf("};\n");
+    return 0;
+}